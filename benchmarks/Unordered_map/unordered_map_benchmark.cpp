@@ -7,13 +7,14 @@
 #include <unordered_map>
 #include <atomic>
 #include <cassert>
+#include "../common/workload.h"
 
 #define MAX_ELEMENTS_PER_THREAD_FOR_COMFORT_TEST (1000000)
 #define KEY(id, k) (id * MAX_ELEMENTS_PER_THREAD_FOR_COMFORT_TEST + k)
 
 using namespace std;
 
-std::atomic_flag lock = ATOMIC_FLAG_INIT;
+std::atomic_flag map_lock = ATOMIC_FLAG_INIT;
 
 struct thread_data {
     int thread_id;
@@ -39,7 +40,7 @@ void *thread_function(void *threadarg) {
     while (!start_the_threads_global_flag);
     start = std::clock();
     while((std::clock() - start) / ((double) CLOCKS_PER_SEC) <= (30 * params->num_of_threads)){
-        while (lock.test_and_set(std::memory_order_acquire));  // acquire lock
+        while (map_lock.test_and_set(std::memory_order_acquire));  // acquire lock
         for (int i = 0; i < 5; ++i) {
             m.insert(make_pair(KEY(insert_id, i),KEY(insert_id++, i)));
             params->number_of_insert_ops++;
@@ -48,7 +49,7 @@ void *thread_function(void *threadarg) {
             m.find(KEY(lookup_id++,i));
             params->number_of_lookup_ops++;
         }
-        lock.clear(std::memory_order_release); // release lock
+        map_lock.clear(std::memory_order_release); // release lock
     }
     pthread_exit(nullptr);
     return nullptr;
@@ -81,7 +82,50 @@ void benchmark_unordered_map(int n_threads) {
     }
 }
 
-int main() {
+template<typename V>
+struct unordered_map_adapter {
+    typedef V value_type;
+    unordered_map<uint64_t, V> m;
+
+    void insert(uint64_t key, V const &value, int) {
+        while (map_lock.test_and_set(std::memory_order_acquire));  // acquire lock
+        m[key] = value;
+        map_lock.clear(std::memory_order_release); // release lock
+    }
+
+    bool read(uint64_t key, V &out, int) {
+        while (map_lock.test_and_set(std::memory_order_acquire));  // acquire lock
+        auto it = m.find(key);
+        bool found = it != m.end();
+        if (found) out = it->second;
+        map_lock.clear(std::memory_order_release); // release lock
+        return found;
+    }
+
+    bool remove(uint64_t key, int) {
+        while (map_lock.test_and_set(std::memory_order_acquire));  // acquire lock
+        bool found = m.erase(key) != 0;
+        map_lock.clear(std::memory_order_release); // release lock
+        return found;
+    }
+};
+
+struct unordered_map_runner {
+    workload_options opt;
+
+    template<typename V>
+    void run() {
+        unordered_map_adapter<V> table;
+        run_benchmark(table, opt, "unordered_map");
+    }
+};
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) { // YCSB style workload, see ../common/workload.h
+        unordered_map_runner runner{parse_workload_args(argc, argv)};
+        dispatch_value_size(runner, runner.opt.value_size);
+        return 0;
+    }
     int n_threads;
 
     std::cout << "Please enter the amount of HW thread this machine supports:" << std::endl;
@@ -0,0 +1,337 @@
+#include <iostream>
+#include "../../src/hashmap.h"
+#include "../common/bench_timing.h"
+#include <pthread.h>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+// Compile with -O2 -DNDEBUG, the asserts in hashmap.h dominate some kernels
+
+// The kernels that work on published bucket states run under both engines
+typedef hashmap_delta<int, int, 0> map_t; // the copy engine, whatever DELTA_CHAIN_LENGTH is
+typedef hashmap_delta<int, int, (DELTA_CHAIN_LENGTH > 0 ? DELTA_CHAIN_LENGTH : 8)> delta_map_t;
+
+/* Friend of hashmap, exposes the internal kernels to this benchmark only */
+struct hashmap_bench_access {
+    typedef map_t::BState BState;
+    typedef map_t::Triple Triple;
+    typedef map_t::Operation Operation;
+    typedef map_t::Bucket_ptr Bucket_ptr;
+    typedef map_t::DState DState;
+
+    // What Buckets publish under the engine of Map, BState for the copy engine
+    template<typename Map>
+    using BNode = typename Map::BNode;
+
+    template<typename Map>
+    using BucketOf = typename Map::Bucket_ptr;
+
+    static uint32_t Prefix(map_t const &m, xxh::hash_t<32> h, uint32_t depth) {
+        return m.Prefix(h, depth);
+    }
+
+    static uint32_t Prefix(map_t const &m, size_t h, uint32_t depth, uint32_t start) {
+        return m.Prefix(h, depth, start);
+    }
+
+    template<typename Map>
+    static int ExecOnBucket(Map &m, shared_ptr<BNode<Map>> const &b, typename Map::Operation const &op) {
+        return m.ExecOnBucket(b, op, 0);
+    }
+
+    // The private next state of a write, a BState copy or the next delta
+    template<typename Map>
+    static shared_ptr<BNode<Map>> NextState(Map &m, shared_ptr<BNode<Map>> const &old) {
+        return m.NextState(0, old);
+    }
+
+    template<typename Map>
+    static shared_ptr<typename Map::Bucket_ptr[]> SplitBucket(Map &m, BucketOf<Map> const &b) {
+        return m.SplitBucket(b, 0);
+    }
+
+    // A depth-1 bucket with prefix 0 over state
+    template<typename Map>
+    static BucketOf<Map> MakeBucket(shared_ptr<BNode<Map>> const &state) {
+        BucketOf<Map> b;
+        b.b_ptr = make_shared<typename Map::Bucket>(0, 1, state, state->applied);
+        return b;
+    }
+
+    static void DirectoryUpdate(map_t &m, DState &d, shared_ptr<Bucket_ptr[]> blist, Bucket_ptr const &b) {
+        m.DirectoryUpdate(d, blist, b, 0);
+    }
+
+    static shared_ptr<DState> Directory(map_t const &m) {
+        return atomic_load(&m.ht);
+    }
+
+    template<typename Map = map_t>
+    static typename Map::Operation MakeInsert(int key, int value) {
+        typename Map::Operation op(Map::INS, key, value);
+        op.seqnum = 1;
+        op.hash = hash_key(key);
+        return op;
+    }
+
+    static xxh::hash_t<32> hash_key(int key) {
+        const void *kptr = &key;
+        return xxh::xxhash<32>(kptr, sizeof(int));
+    }
+
+    /* A BState holding fill items, all with the top hash bit cleared so it
+     * belongs to the depth-1 bucket with prefix 0. */
+    template<typename Map = map_t>
+    static shared_ptr<typename Map::BState> FilledState(Map &m, int fill) {
+        shared_ptr<typename Map::BState> bs = m.NewBState(0);
+        for (int key = 0, n = 0; n < fill; ++key) {
+            xxh::hash_t<32> h = hash_key(key);
+            if (h >> (SIZE_OF_HASH - 1)) continue;
+            bs->InsertItem(typename Map::Triple(h, key, key));
+            ++n;
+        }
+        return bs;
+    }
+
+    // The filled state as Map publishes it, a first delta over it for the delta engine
+    template<typename Map>
+    static shared_ptr<BNode<Map>> FilledNode(Map &m, int fill) {
+        return Map::AsNode(FilledState(m, fill));
+    }
+
+    template<typename Node>
+    static int KeyAt(shared_ptr<Node> const &bs, int i) {
+        return bs->KeyAt(i);
+    }
+};
+
+typedef hashmap_bench_access access;
+
+static bench_config cfg = {3, 15, 20000};
+
+void bench_prefix(map_t &m) {
+    std::vector<xxh::hash_t<32>> hashes(1024);
+    for (int i = 0; i < 1024; ++i) hashes[i] = access::hash_key(i);
+    print_result(std::cout, "Prefix(hash, depth)", measure(cfg, [&](uint64_t i) {
+        do_not_optimize(access::Prefix(m, hashes[i & 1023], 1 + (i & 15)));
+    }));
+    print_result(std::cout, "Prefix(entry, depth, start)", measure(cfg, [&](uint64_t i) {
+        do_not_optimize(access::Prefix(m, (size_t) (i & 0xffff), 1 + (i & 15), 16));
+    }));
+}
+
+void bench_bstate(map_t &m) {
+    shared_ptr<access::BState> full = access::FilledState(m, BUCKET_SIZE);
+    print_result(std::cout, "BState copy construction", measure(cfg, [&](uint64_t) {
+        access::BState copy(*full);
+        do_not_optimize(copy);
+    }));
+
+    for (int fill : {0, BUCKET_SIZE / 5, BUCKET_SIZE / 2, BUCKET_SIZE - 1, BUCKET_SIZE}) {
+        shared_ptr<access::BState> bs = access::FilledState(m, fill);
+        std::string suffix = " fill " + std::to_string(fill);
+        print_result(std::cout, "BucketAvailability" + suffix, measure(cfg, [&](uint64_t) {
+            do_not_optimize(bs->BucketAvailability());
+        }));
+        // hit on the last stored item (worst case hit) or a miss on an empty bucket
+        access::Triple probe(0, fill ? access::KeyAt(bs, fill - 1) : -1, 0);
+        print_result(std::cout, "GetItem hit" + suffix, measure(cfg, [&](uint64_t) {
+            do_not_optimize(bs->GetItem(probe));
+        }));
+        access::Triple miss(0, -1, 0);
+        print_result(std::cout, "GetItem miss" + suffix, measure(cfg, [&](uint64_t) {
+            do_not_optimize(bs->GetItem(miss));
+        }));
+    }
+}
+
+// The kernels of a write under the engine of Map, engine names the results
+template<typename Map>
+void bench_exec(Map &m, std::string const &engine) {
+    auto const bs = access::FilledNode(m, BUCKET_SIZE - 1); // the types of Map are private
+    auto const update = access::MakeInsert<Map>(access::KeyAt(bs, 0), 7);
+    print_result(std::cout, "ExecOnBucket update, " + engine, measure(cfg, [&](uint64_t) {
+        do_not_optimize(access::ExecOnBucket(m, bs, update));
+    }));
+    auto const insert = access::MakeInsert<Map>(-1, 7);
+    print_result(std::cout, "NextState + ExecOnBucket insert, " + engine, measure(cfg, [&](uint64_t) {
+        auto const next = access::NextState(m, bs);
+        do_not_optimize(access::ExecOnBucket(m, next, insert));
+    }));
+    auto const bucket = access::MakeBucket<Map>(access::FilledNode(m, BUCKET_SIZE));
+    print_result(std::cout, "SplitBucket, " + engine, measure(cfg, [&](uint64_t) {
+        do_not_optimize(access::SplitBucket(m, bucket));
+    }));
+}
+
+void bench_directory(map_t &m) {
+    access::Bucket_ptr bucket = access::MakeBucket<map_t>(access::FilledNode(m, BUCKET_SIZE));
+
+    bench_config dir_cfg = {2, 9, 200};
+    for (size_t depth : {4, 10, 16}) {
+        access::DState d;
+        while (d.depth < depth) d.EnlargeDir();
+        for (size_t e = 0; e < POW(depth - 1); ++e) d.dir[e] = bucket; // full bucket covers the lower half
+        shared_ptr<access::Bucket_ptr[]> splitted = access::SplitBucket(m, bucket);
+        std::string suffix = " depth " + std::to_string(depth);
+        print_result(std::cout, "DState copy" + suffix, measure(dir_cfg, [&](uint64_t) {
+            access::DState copy(d);
+            do_not_optimize(copy);
+        }));
+        print_result(std::cout, "DState copy + DirectoryUpdate" + suffix, measure(dir_cfg, [&](uint64_t) {
+            access::DState copy(d);
+            access::DirectoryUpdate(m, copy, splitted, bucket);
+            do_not_optimize(copy);
+        }));
+    }
+}
+
+void bench_hash() {
+    print_result(std::cout, "xxhash32 int key", measure(cfg, [&](uint64_t i) {
+        int key = (int) i;
+        do_not_optimize(access::hash_key(key));
+    }));
+    std::vector<int> keys(1024);
+    for (int i = 0; i < 1024; ++i) keys[i] = i;
+    xxh::hash_t<32> out[LOOKUP_BATCH_SIZE];
+    bench_config batch_cfg = {cfg.warmup_reps, cfg.reps, cfg.ops_per_rep / LOOKUP_BATCH_SIZE};
+    bench_result r = measure(batch_cfg, [&](uint64_t i) {
+        hashmap_hash<int>().Batch(&keys[(i * LOOKUP_BATCH_SIZE) & 1023], LOOKUP_BATCH_SIZE, out);
+        do_not_optimize(out);
+    });
+    r.median_ns /= LOOKUP_BATCH_SIZE, r.mad_ns /= LOOKUP_BATCH_SIZE, r.median_cycles /= LOOKUP_BATCH_SIZE;
+    print_result(std::cout, "xxhash32 int key, Batch per key", r);
+}
+
+/* Random reads of a table bigger than the LLC, one lookup at a time and in
+ * batches of LOOKUP_BATCH_SIZE, both reported per key */
+void bench_lookup() {
+    int const records = 1 << 20;
+    map_t big{};
+    for (int i = 0; i < records; ++i) big.insert(i, i, 0);
+    std::vector<int> keys(1 << 16);
+    uint64_t x = 88172645463325252ULL;
+    for (int &k : keys) {
+        x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+        k = (int) (x % records);
+    }
+    size_t const mask = keys.size() - 1;
+    print_result(std::cout, "lookup, table of 2^20", measure(cfg, [&](uint64_t i) {
+        do_not_optimize(big.lookup(keys[i & mask]));
+    }));
+    bench_config batch_cfg = {cfg.warmup_reps, cfg.reps, cfg.ops_per_rep / LOOKUP_BATCH_SIZE};
+    std::pair<bool, int> out[LOOKUP_BATCH_SIZE];
+    bench_result r = measure(batch_cfg, [&](uint64_t i) {
+        do_not_optimize(big.lookup_batch(&keys[(i * LOOKUP_BATCH_SIZE) & mask], LOOKUP_BATCH_SIZE, out));
+    });
+    r.median_ns /= LOOKUP_BATCH_SIZE, r.mad_ns /= LOOKUP_BATCH_SIZE, r.median_cycles /= LOOKUP_BATCH_SIZE;
+    print_result(std::cout, "lookup_batch per key, table of 2^20", r);
+}
+
+/*** Contended kernels: the same kernel on n threads at once ***/
+
+struct thread_data {
+    int thread_id;
+    map_t *m;
+    std::vector<int> keys; // keys this thread updates
+    shared_ptr<access::BState> shared_state;
+    bench_result result;
+};
+
+bool start_the_threads_global_flag;
+
+void *copy_thread_function(void *threadarg) {
+    struct thread_data *params = (struct thread_data *) threadarg;
+    while (!start_the_threads_global_flag);
+    params->result = measure(cfg, [&](uint64_t) {
+        access::BState copy(*params->shared_state);
+        do_not_optimize(copy);
+    });
+    pthread_exit(nullptr);
+    return nullptr;
+}
+
+void *update_thread_function(void *threadarg) {
+    struct thread_data *params = (struct thread_data *) threadarg;
+    map_t &m = *(params->m);
+    size_t n = params->keys.size();
+    while (!start_the_threads_global_flag);
+    params->result = measure({1, 5, 2000}, [&](uint64_t i) {
+        int key = params->keys[i % n];
+        do_not_optimize(m.insert(key, (int) i, params->thread_id));
+    });
+    pthread_exit(nullptr);
+    return nullptr;
+}
+
+void run_threads(std::string const &name, int num_threads, void *(*f)(void *), std::vector<thread_data> &td) {
+    pthread_t threads[num_threads];
+    start_the_threads_global_flag = false;
+    for (int id = 0; id < num_threads; ++id) {
+        int rc = pthread_create(&threads[id], nullptr, f, (void *) &td[id]);
+        assert(rc == 0); // Error: unable to create thread
+    }
+    start_the_threads_global_flag = true;
+    for (int id = 0; id < num_threads; ++id)
+        pthread_join(threads[id], nullptr);
+
+    // median over the per thread medians
+    std::vector<double> ns, cycles, deviations;
+    for (thread_data const &t : td) {
+        ns.push_back(t.result.median_ns);
+        cycles.push_back(t.result.median_cycles);
+    }
+    bench_result r{median_of(ns), 0, median_of(cycles)};
+    for (double x : ns) deviations.push_back(std::fabs(x - r.median_ns));
+    r.mad_ns = median_of(deviations);
+    print_result(std::cout, name + " x" + std::to_string(num_threads), r);
+}
+
+void bench_contention(int num_threads) {
+    map_t m{};
+    shared_ptr<access::BState> full = access::FilledState(m, BUCKET_SIZE);
+    std::vector<thread_data> td(num_threads);
+    for (int id = 0; id < num_threads; ++id)
+        td[id] = {id, nullptr, {}, full, {}};
+    run_threads("BState copy, shared source", num_threads, copy_thread_function, td);
+
+    // preload so that every thread can own a bucket, then update existing
+    // keys only (no splits): all threads in one bucket vs one bucket each
+    const int preload = 64 * BUCKET_SIZE * num_threads;
+    for (int key = 0; key < preload; ++key) m.insert(key, key, 0);
+    shared_ptr<access::DState> htl = access::Directory(m);
+    std::vector<std::vector<int>> by_bucket(POW(htl->depth));
+    for (int key = 0; key < preload; ++key)
+        by_bucket[access::Prefix(m, access::hash_key(key), htl->depth)].push_back(key);
+    std::vector<std::vector<int>> private_keys;
+    for (size_t e = 0; e < by_bucket.size() && (int) private_keys.size() < num_threads; ++e)
+        if (!by_bucket[e].empty() && (e == 0 || htl->dir[e].b_ptr != htl->dir[e - 1].b_ptr))
+            private_keys.push_back(by_bucket[e]);
+    assert((int) private_keys.size() == num_threads);
+
+    for (int id = 0; id < num_threads; ++id)
+        td[id] = {id, &m, private_keys[0], nullptr, {}};
+    run_threads("insert update, one shared bucket", num_threads, update_thread_function, td);
+    for (int id = 0; id < num_threads; ++id)
+        td[id] = {id, &m, private_keys[id], nullptr, {}};
+    run_threads("insert update, bucket per thread", num_threads, update_thread_function, td);
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 4;
+    map_t m{};
+
+    print_result_header(std::cout);
+    bench_prefix(m);
+    bench_hash();
+    bench_bstate(m);
+    bench_exec(m, "copy engine");
+    delta_map_t dm{};
+    bench_exec(dm, "delta engine");
+    bench_directory(m);
+    bench_lookup();
+    for (int n = 1; n <= max_threads; n *= 2)
+        bench_contention(n);
+    return 0;
+}
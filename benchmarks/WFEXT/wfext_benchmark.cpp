@@ -1,5 +1,6 @@
 #include <iostream>
 #include "../../src/hashmap.h"
+#include "../common/workload.h"
 #include <pthread.h>
 #include <unistd.h> // for sleep
 #include <ctime>
@@ -75,7 +76,56 @@ void benchmark_wfext(int n_threads) {
     }
 }
 
-int main() {
+template<typename V>
+struct wfext_adapter {
+    typedef V value_type;
+    hashmap<uint64_t, V> m;
+
+    void insert(uint64_t key, V const &value, int id) {
+        m.insert(key, value, id);
+    }
+
+    bool read(uint64_t key, V &out, int) {
+        std::pair<bool, V> t = m.lookup(key);
+        out = t.second;
+        return t.first;
+    }
+
+    bool remove(uint64_t key, int id) {
+        return m.remove(key, id);
+    }
+
+    size_t depth() const {
+        return m.global_depth();
+    }
+
+    int max_threads() const {
+        return NUMBER_OF_THREADS;
+    }
+
+    size_t reachable_bytes() const {
+        hashmap_layout_report r = m.layout_report();
+        return sizeof(*this) + r.directory_bytes + r.bucket_bytes + r.bstate_bytes + r.value_bytes;
+    }
+};
+
+struct wfext_runner {
+    workload_options opt;
+
+    template<typename V>
+    void run() {
+        wfext_adapter<V> *table = new wfext_adapter<V>(); // help[] holds a value per thread, keep it off the stack
+        run_benchmark(*table, opt, "WFEXT");
+        delete table;
+    }
+};
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) { // YCSB style workload, see ../common/workload.h
+        wfext_runner runner{parse_workload_args(argc, argv)};
+        dispatch_value_size(runner, runner.opt.value_size);
+        return 0;
+    }
     int n_threads;
 
     std::cout << "Please enter the amount of HW thread this machine supports:" << std::endl;
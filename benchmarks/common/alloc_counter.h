@@ -0,0 +1,225 @@
+#ifndef BENCH_ALLOC_COUNTER_H
+#define BENCH_ALLOC_COUNTER_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <string>
+#include <vector>
+#include <malloc.h> // for malloc_usable_size
+#include <sys/resource.h>
+#include <unistd.h>
+
+/*** Counting allocator for the memory benchmarks ***/
+/**Compiling a driver with -DBENCH_COUNT_ALLOCATIONS replaces the global
+ * operator new/delete of that program with versions that count the usable
+ * size of every block, in per-thread slots so that counting does not add a
+ * shared cache line to every allocation. Without it the counters stay zero
+ * and alloc_counting_available() is false.
+ * This header defines the replacement operators, include it (through
+ * workload.h) from exactly one translation unit.
+ * **/
+
+#define ALLOC_COUNTER_SLOTS (256)
+
+struct alloc_totals {
+    int64_t live_bytes;       // allocated and not yet freed
+    uint64_t allocated_bytes; // ever allocated
+    uint64_t allocations;
+};
+
+struct alignas(64) alloc_slot {
+    std::atomic<int64_t> live_bytes;
+    std::atomic<uint64_t> allocated_bytes;
+    std::atomic<uint64_t> allocations;
+};
+
+inline alloc_slot *alloc_slots() {
+    static alloc_slot slots[ALLOC_COUNTER_SLOTS]; // zero initialized, no allocation
+    return slots;
+}
+
+inline alloc_slot &local_alloc_slot() {
+    static std::atomic<unsigned int> next{0};
+    thread_local unsigned int slot = next.fetch_add(1, std::memory_order_relaxed) % ALLOC_COUNTER_SLOTS;
+    return alloc_slots()[slot];
+}
+
+inline alloc_totals read_alloc_totals() {
+    alloc_totals res{0, 0, 0};
+    for (int i = 0; i < ALLOC_COUNTER_SLOTS; ++i) {
+        res.live_bytes += alloc_slots()[i].live_bytes.load(std::memory_order_relaxed);
+        res.allocated_bytes += alloc_slots()[i].allocated_bytes.load(std::memory_order_relaxed);
+        res.allocations += alloc_slots()[i].allocations.load(std::memory_order_relaxed);
+    }
+    return res;
+}
+
+inline bool alloc_counting_available() {
+#ifdef BENCH_COUNT_ALLOCATIONS
+    return true;
+#else
+    return false;
+#endif
+}
+
+inline size_t current_rss_bytes() {
+    long pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        long size;
+        if (fscanf(f, "%ld %ld", &size, &pages) != 2) pages = 0;
+        fclose(f);
+    }
+    return (size_t) pages * (size_t) sysconf(_SC_PAGESIZE);
+}
+
+inline size_t peak_rss_bytes() {
+    struct rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return (size_t) usage.ru_maxrss * 1024; // KB on Linux
+}
+
+#ifdef BENCH_COUNT_ALLOCATIONS
+
+inline void count_allocation(void *p) {
+    if (!p) return;
+    alloc_slot &slot = local_alloc_slot();
+    int64_t size = (int64_t) malloc_usable_size(p);
+    slot.live_bytes.fetch_add(size, std::memory_order_relaxed);
+    slot.allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    slot.allocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline void count_free(void *p) {
+    if (!p) return;
+    local_alloc_slot().live_bytes.fetch_sub((int64_t) malloc_usable_size(p), std::memory_order_relaxed);
+}
+
+void *operator new(size_t size) {
+    void *p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    count_allocation(p);
+    return p;
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void *operator new(size_t size, std::align_val_t al) {
+    size_t align = (size_t) al;
+    void *p = aligned_alloc(align, (size + align - 1) / align * align);
+    if (!p) throw std::bad_alloc();
+    count_allocation(p);
+    return p;
+}
+
+void *operator new[](size_t size, std::align_val_t al) {
+    return operator new(size, al);
+}
+
+void operator delete(void *p) noexcept {
+    count_free(p);
+    free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    operator delete(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    operator delete(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    operator delete(p);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept {
+    operator delete(p);
+}
+
+void operator delete[](void *p, std::align_val_t) noexcept {
+    operator delete(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+    operator delete(p);
+}
+
+void operator delete[](void *p, size_t, std::align_val_t) noexcept {
+    operator delete(p);
+}
+
+#endif //BENCH_COUNT_ALLOCATIONS
+
+/*** Memory report of one workload run ***/
+/**@reachable_bytes - what the table can still reach from its root (0 when the
+ * adapter cannot tell); live minus reachable is memory that was retired
+ * (replaced BStates, old directories) but is not reclaimed yet.
+ * **/
+class memory_report {
+    struct sample {
+        double time_ms;
+        int64_t live_bytes;
+        size_t reachable_bytes;
+        size_t rss_bytes;
+        uint64_t allocated_bytes;
+    };
+
+    alloc_totals before_load{}, after_load{}, after_run{};
+    uint64_t load_ops = 0, run_ops = 0;
+    std::vector<sample> samples;
+
+public:
+    void load_started() {
+        before_load = read_alloc_totals();
+    }
+
+    void load_done(uint64_t ops) {
+        after_load = read_alloc_totals();
+        load_ops = ops;
+    }
+
+    void run_done(uint64_t ops) {
+        after_run = read_alloc_totals();
+        run_ops = ops;
+    }
+
+    void poll(double now_ms, size_t reachable_bytes) {
+        alloc_totals t = read_alloc_totals();
+        samples.push_back({now_ms, t.live_bytes, reachable_bytes, current_rss_bytes(), t.allocated_bytes});
+    }
+
+    void write(std::string const &path, std::string const &title, uint64_t keys) const {
+        std::ofstream outfile(path);
+        double load_per_op = load_ops ? (double) (after_load.allocated_bytes - before_load.allocated_bytes) / load_ops : 0;
+        double run_per_op = run_ops ? (double) (after_run.allocated_bytes - after_load.allocated_bytes) / run_ops : 0;
+        outfile << "# " << title << std::endl
+                << "# keys: " << keys << std::endl
+                << "# live bytes per key after load: "
+                << (double) (after_load.live_bytes - before_load.live_bytes) / keys << std::endl
+                << "# bytes allocated per op, load: " << load_per_op << ", run: " << run_per_op << std::endl
+                << "# peak rss bytes: " << peak_rss_bytes() << std::endl;
+        outfile << "Time ms, Live bytes, Reachable bytes, Unreclaimed bytes, RSS bytes, Allocated bytes" << std::endl;
+        for (sample const &s : samples) {
+            int64_t unreclaimed = s.reachable_bytes ? s.live_bytes - (int64_t) s.reachable_bytes : 0;
+            outfile << s.time_ms << ", " << s.live_bytes << ", " << s.reachable_bytes << ", " << unreclaimed
+                    << ", " << s.rss_bytes << ", " << s.allocated_bytes << std::endl;
+        }
+    }
+
+    void print_summary(std::ostream &os, uint64_t keys) const {
+        os << "  live bytes per key " << (double) (after_load.live_bytes - before_load.live_bytes) / keys
+           << ", bytes allocated per op (load) "
+           << (load_ops ? (double) (after_load.allocated_bytes - before_load.allocated_bytes) / load_ops : 0)
+           << ", (run) " << (run_ops ? (double) (after_run.allocated_bytes - after_load.allocated_bytes) / run_ops : 0)
+           << ", peak rss " << peak_rss_bytes() << std::endl;
+    }
+};
+
+#endif //BENCH_ALLOC_COUNTER_H
@@ -0,0 +1,87 @@
+#ifndef BENCH_TIMING_H
+#define BENCH_TIMING_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAS_RDTSC (1)
+#endif
+
+/* Keeps the compiler from optimizing a value (and the work producing it) away */
+template<typename T>
+inline void do_not_optimize(T const &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+inline uint64_t read_cycles() {
+#ifdef BENCH_HAS_RDTSC
+    return __rdtsc(); // reference cycles, constant rate on modern x86
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+struct bench_config {
+    int warmup_reps;
+    int reps;
+    uint64_t ops_per_rep;
+};
+
+struct bench_result {
+    double median_ns;   // per op
+    double mad_ns;      // median absolute deviation of the per op time
+    double median_cycles; // per op, rdtsc (or ns without rdtsc)
+};
+
+inline double median_of(std::vector<double> v) {
+    std::sort(v.begin(), v.end());
+    size_t n = v.size();
+    return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+/* Runs f(i) ops_per_rep times per repetition, after warmup_reps untimed
+ * repetitions, and summarizes the per op time over the repetitions. */
+template<typename F>
+bench_result measure(bench_config const &cfg, F &&f) {
+    std::vector<double> ns, cycles;
+    for (int r = 0; r < cfg.warmup_reps + cfg.reps; ++r) {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t c0 = read_cycles();
+        for (uint64_t i = 0; i < cfg.ops_per_rep; ++i)
+            f(i);
+        uint64_t c1 = read_cycles();
+        auto end = std::chrono::steady_clock::now();
+        if (r < cfg.warmup_reps) continue;
+        ns.push_back(std::chrono::duration<double, std::nano>(end - start).count() / cfg.ops_per_rep);
+        cycles.push_back((double) (c1 - c0) / cfg.ops_per_rep);
+    }
+    bench_result res{};
+    res.median_ns = median_of(ns);
+    for (double &x : ns) x = std::fabs(x - res.median_ns);
+    res.mad_ns = median_of(ns);
+    res.median_cycles = median_of(cycles);
+    return res;
+}
+
+inline void print_result_header(std::ostream &os) {
+    os << std::left << std::setw(44) << "kernel" << std::right
+       << std::setw(12) << "median ns" << std::setw(10) << "mad ns"
+       << std::setw(12) << "cycles" << std::endl;
+}
+
+inline void print_result(std::ostream &os, std::string const &name, bench_result const &r) {
+    os << std::left << std::setw(44) << name << std::right << std::fixed << std::setprecision(2)
+       << std::setw(12) << r.median_ns << std::setw(10) << r.mad_ns
+       << std::setw(12) << r.median_cycles << std::endl;
+}
+
+#endif //BENCH_TIMING_H
@@ -0,0 +1,130 @@
+#ifndef BENCH_PERF_COUNTERS_H
+#define BENCH_PERF_COUNTERS_H
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*** Hardware performance counters for the benchmark drivers ***/
+/**Every benchmark thread opens its own counters (this thread, any cpu, user
+ * space only) and enables them only while the measured phase runs. A counter
+ * the kernel refuses (no PMU, perf_event_paranoid, a container) is reported as
+ * unavailable and the benchmark runs on without it. Values are scaled by
+ * time_enabled / time_running when the kernel multiplexes counters.
+ * **/
+
+enum perf_counter_type {
+    PERF_CYCLES, PERF_INSTRUCTIONS, PERF_L1D_MISSES, PERF_LLC_MISSES, PERF_DTLB_MISSES, PERF_BRANCH_MISSES,
+    NUM_OF_PERF_COUNTERS
+};
+
+inline const char *perf_counter_name(int c) {
+    static const char *const names[NUM_OF_PERF_COUNTERS] = {
+            "cycles", "instructions", "L1d misses", "LLC misses", "dTLB misses", "branch misses"
+    };
+    return names[c];
+}
+
+struct perf_values {
+    double value[NUM_OF_PERF_COUNTERS];
+    bool available[NUM_OF_PERF_COUNTERS];
+
+    perf_values() : value(), available() {}
+
+    void add(perf_values const &other) {
+        for (int c = 0; c < NUM_OF_PERF_COUNTERS; ++c) {
+            value[c] += other.value[c];
+            available[c] = available[c] || other.available[c];
+        }
+    }
+
+    /* One line: "<name> <value / ops>" for every available counter */
+    void print_per_op(std::ostream &os, uint64_t ops) const {
+        os << "  per op:";
+        bool any = false;
+        for (int c = 0; c < NUM_OF_PERF_COUNTERS; ++c) {
+            if (!available[c]) continue;
+            os << " " << perf_counter_name(c) << " " << (ops ? value[c] / ops : 0);
+            any = true;
+        }
+        if (available[PERF_CYCLES] && available[PERF_INSTRUCTIONS] && value[PERF_CYCLES] > 0)
+            os << ", IPC " << value[PERF_INSTRUCTIONS] / value[PERF_CYCLES];
+        if (!any) os << " perf events unavailable";
+        os << std::endl;
+    }
+};
+
+class thread_perf_counters {
+    int fds[NUM_OF_PERF_COUNTERS];
+
+    static int open_counter(uint32_t type, uint64_t config) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    static uint64_t cache_miss(uint64_t cache) {
+        return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    }
+
+public:
+    thread_perf_counters() {
+        for (int &fd : fds) fd = -1;
+    }
+
+    thread_perf_counters(thread_perf_counters const &) = delete;
+
+    thread_perf_counters operator=(thread_perf_counters) = delete;
+
+    ~thread_perf_counters() {
+        for (int fd : fds)
+            if (fd >= 0) close(fd);
+    }
+
+    /* Opens the counters for the calling thread, disabled */
+    void open() {
+        fds[PERF_CYCLES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        fds[PERF_INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        fds[PERF_L1D_MISSES] = open_counter(PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_L1D));
+        fds[PERF_LLC_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        fds[PERF_DTLB_MISSES] = open_counter(PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_DTLB));
+        fds[PERF_BRANCH_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    }
+
+    void start() {
+        for (int fd : fds) {
+            if (fd < 0) continue;
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    void stop() {
+        for (int fd : fds)
+            if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    perf_values read_values() const {
+        perf_values res;
+        for (int c = 0; c < NUM_OF_PERF_COUNTERS; ++c) {
+            uint64_t data[3]; // value, time enabled, time running
+            if (fds[c] < 0 || read(fds[c], data, sizeof(data)) != sizeof(data)) continue;
+            res.available[c] = true;
+            res.value[c] = data[2] ? (double) data[0] * data[1] / data[2] : 0;
+        }
+        return res;
+    }
+};
+
+#endif //BENCH_PERF_COUNTERS_H
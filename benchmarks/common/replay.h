@@ -0,0 +1,219 @@
+#ifndef BENCH_REPLAY_H
+#define BENCH_REPLAY_H
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <vector>
+#include "../../src/trace.h"
+
+/*** Trace record and replay for the benchmark drivers, included by workload.h ***/
+/**@recording_adapter - wraps a driver's adapter, records every op of a
+ * workload run (preload included) into a trace, see src/trace.h.
+ * @run_replay - replays a trace against an adapter. Every recorded thread is
+ * replayed in its recorded order by one replay thread (recorded threads are
+ * spread round robin when there are fewer replay threads, at most
+ * max_threads without --threads).
+ *  closed loop - each thread issues its next op as soon as the last one is done.
+ *  open loop - each op is issued at its recorded time (relative to the start
+ *  of the trace), latency is measured from that time so queueing shows up.
+ * **/
+
+template<typename Adapter>
+struct recording_adapter {
+    typedef typename Adapter::value_type value_type;
+    Adapter &table;
+    trace_recorder &recorder;
+
+    void insert(uint64_t key, value_type const &value, int id) {
+        recorder.Record(TRACE_INSERT, key, sizeof(value_type), id);
+        table.insert(key, value, id);
+    }
+
+    bool read(uint64_t key, value_type &out, int id) {
+        recorder.Record(TRACE_LOOKUP, key, sizeof(value_type), id);
+        return table.read(key, out, id);
+    }
+
+    bool remove(uint64_t key, int id) {
+        recorder.Record(TRACE_REMOVE, key, sizeof(value_type), id);
+        return table.remove(key, id);
+    }
+
+    size_t depth() {
+        return table_depth(table, 0);
+    }
+
+    size_t reachable_bytes() {
+        return table_reachable_bytes(table, 0);
+    }
+};
+
+struct replay_thread_result {
+    uint64_t ops[3];
+    std::vector<uint32_t> latency_ns; // per op, saturated at 4s
+    perf_values perf;
+};
+
+template<typename Adapter>
+struct replay_thread_data {
+    int thread_id;
+    Adapter *table;
+    std::vector<trace_record> records; // in replay order
+    bool open_loop;
+    bool warm;
+    bool perf;
+    uint64_t trace_start_ns;
+    std::atomic<int> *warmed;
+    std::atomic<bool> *start;
+    std::chrono::steady_clock::time_point *start_time;
+    replay_thread_result result;
+};
+
+template<typename Adapter>
+void *replay_thread_function(void *threadarg) {
+    typedef typename Adapter::value_type value_type;
+    typedef std::chrono::steady_clock clock;
+    replay_thread_data<Adapter> *params = (replay_thread_data<Adapter> *) threadarg;
+    Adapter &table = *(params->table);
+    int id = params->thread_id;
+    value_type value(id), out;
+    thread_perf_counters perf;
+    if (params->perf) perf.open();
+
+    if (params->warm) { // every key of this thread's stream exists before the replay
+        std::vector<uint64_t> keys;
+        for (trace_record const &r : params->records) keys.push_back(r.key);
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        for (uint64_t key : keys) table.insert(key, value, id);
+    }
+    params->warmed->fetch_add(1);
+    while (!params->start->load(std::memory_order_acquire));
+    clock::time_point start = *(params->start_time);
+    if (params->perf) perf.start();
+
+    params->result.latency_ns.reserve(params->records.size());
+    for (trace_record const &r : params->records) {
+        clock::time_point issue = clock::now();
+        if (params->open_loop) {
+            issue = start + std::chrono::nanoseconds(r.timestamp_ns - params->trace_start_ns);
+            while (clock::now() < issue) sched_yield();
+        }
+        switch (r.op) {
+            case TRACE_INSERT:
+                table.insert(r.key, value, id);
+                break;
+            case TRACE_REMOVE:
+                table.remove(r.key, id);
+                break;
+            default:
+                table.read(r.key, out, id);
+                break;
+        }
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - issue).count();
+        params->result.latency_ns.push_back(ns < 4000000000ULL ? (uint32_t) ns : 4000000000U);
+        params->result.ops[std::min<uint8_t>(r.op, TRACE_LOOKUP)]++;
+    }
+    if (params->perf) {
+        perf.stop();
+        params->result.perf = perf.read_values();
+    }
+    pthread_exit(nullptr);
+    return nullptr;
+}
+
+inline uint32_t percentile(std::vector<uint32_t> const &sorted, double p) {
+    if (sorted.empty()) return 0;
+    return sorted[std::min(sorted.size() - 1, (size_t) (p * sorted.size()))];
+}
+
+/* Replays opt.replay_path, prints throughput and latency percentiles and writes
+ * per thread results to replay_<table_name>_threads_<n>. Returns the op count. */
+template<typename Adapter>
+uint64_t run_replay(Adapter &table, workload_options const &opt, std::string const &table_name,
+                    int const max_threads) {
+    std::vector<trace_record> records;
+    if (!ReadTrace(opt.replay_path, records)) {
+        std::cerr << "Can't read trace: " << opt.replay_path << std::endl;
+        exit(1);
+    }
+    std::stable_sort(records.begin(), records.end(), [](trace_record const &a, trace_record const &b) {
+        return a.thread != b.thread ? a.thread < b.thread : a.timestamp_ns < b.timestamp_ns;
+    });
+    std::map<uint16_t, int> recorded_threads; // recorded thread -> replay thread
+    uint64_t trace_start_ns = records.empty() ? 0 : records[0].timestamp_ns;
+    for (trace_record const &r : records) {
+        recorded_threads.emplace(r.thread, 0);
+        trace_start_ns = std::min(trace_start_ns, r.timestamp_ns);
+        if (r.value_size != opt.value_size && r.value_size != 0) {
+            std::cerr << "Note: trace has values of " << r.value_size << " bytes, replaying with "
+                      << opt.value_size << std::endl;
+            break;
+        }
+    }
+    int num_threads = opt.threads_set ? opt.threads : std::max<int>(1, (int) recorded_threads.size());
+    num_threads = std::min(num_threads, max_threads);
+    int next = 0;
+    for (auto &t : recorded_threads) t.second = next++ % num_threads;
+
+    std::atomic<int> warmed(0);
+    std::atomic<bool> start(false);
+    std::chrono::steady_clock::time_point start_time;
+    std::vector<pthread_t> threads(num_threads);
+    std::vector<replay_thread_data<Adapter>> td(num_threads);
+    for (int id = 0; id < num_threads; ++id)
+        td[id] = {id, &table, {}, opt.open_loop, opt.warm, opt.perf, trace_start_ns, &warmed, &start, &start_time, {}};
+    for (trace_record const &r : records)
+        td[recorded_threads[r.thread]].records.push_back(r);
+    for (int id = 0; id < num_threads; ++id) { // several recorded threads on one replay thread, keep time order
+        std::stable_sort(td[id].records.begin(), td[id].records.end(), [](trace_record const &a, trace_record const &b) {
+            return a.timestamp_ns < b.timestamp_ns;
+        });
+        int rc = pthread_create(&threads[id], nullptr, replay_thread_function<Adapter>, (void *) &td[id]);
+        assert(rc == 0); // Error: unable to create thread
+    }
+    while (warmed.load() < num_threads);
+
+    start_time = std::chrono::steady_clock::now();
+    start.store(true, std::memory_order_release);
+    for (int id = 0; id < num_threads; ++id)
+        pthread_join(threads[id], nullptr);
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+    uint64_t total = 0;
+    std::vector<uint32_t> latencies;
+    perf_values perf;
+    std::ofstream outfile("replay_" + table_name + "_threads_" + std::to_string(num_threads));
+    outfile << "Thread ID, Number of insert ops, Number of remove ops, Number of lookup ops, p50 ns, p99 ns" << std::endl;
+    for (int id = 0; id < num_threads; ++id) {
+        replay_thread_result &res = td[id].result;
+        total += res.ops[TRACE_INSERT] + res.ops[TRACE_REMOVE] + res.ops[TRACE_LOOKUP];
+        std::sort(res.latency_ns.begin(), res.latency_ns.end());
+        outfile << id << ", " << res.ops[TRACE_INSERT] << ", " << res.ops[TRACE_REMOVE] << ", "
+                << res.ops[TRACE_LOOKUP] << ", " << percentile(res.latency_ns, 0.5) << ", "
+                << percentile(res.latency_ns, 0.99) << std::endl;
+        latencies.insert(latencies.end(), res.latency_ns.begin(), res.latency_ns.end());
+        perf.add(res.perf);
+    }
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << table_name << " replay of " << opt.replay_path << " (" << (opt.open_loop ? "open" : "closed")
+              << " loop), " << num_threads << " threads: " << total << " ops in " << elapsed << " s, "
+              << (uint64_t) (total / elapsed) << " ops/sec, latency ns p50 " << percentile(latencies, 0.5)
+              << " p99 " << percentile(latencies, 0.99) << " p99.9 " << percentile(latencies, 0.999) << std::endl;
+    if (opt.perf) {
+        perf.print_per_op(std::cout, total);
+        perf.print_per_op(outfile, total);
+    }
+    return total;
+}
+
+#endif //BENCH_REPLAY_H
@@ -0,0 +1,109 @@
+#ifndef BENCH_TIMELINE_H
+#define BENCH_TIMELINE_H
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/*** Throughput over time ***/
+/**@progress_counter - ops completed by one thread, written only by that
+ * thread (relaxed) and read by the sampler, one per cache line.
+ * @throughput_timeline - samples the counters every interval_ms and records
+ * every change of the table's directory depth, so resize stalls show up as
+ * dips next to the depth change that caused them.
+ * **/
+
+struct alignas(64) progress_counter {
+    std::atomic<uint64_t> ops{0};
+
+    void add() {
+        ops.store(ops.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+};
+
+// The directory depth of tables that expose depth(), 0 for the others
+template<typename Table>
+auto table_depth(Table &t, int) -> decltype((size_t) t.depth()) {
+    return t.depth();
+}
+
+template<typename Table>
+size_t table_depth(Table &, long) {
+    return 0;
+}
+
+// The bytes reachable from the root of tables that expose reachable_bytes()
+template<typename Table>
+auto table_reachable_bytes(Table &t, int) -> decltype((size_t) t.reachable_bytes()) {
+    return t.reachable_bytes();
+}
+
+template<typename Table>
+size_t table_reachable_bytes(Table &, long) {
+    return 0;
+}
+
+class throughput_timeline {
+    struct sample {
+        double time_ms;
+        std::vector<uint64_t> ops; // per thread, cumulative
+        size_t depth;
+    };
+
+    struct depth_change {
+        double time_ms;
+        size_t from, to;
+    };
+
+    progress_counter const *counters;
+    int num_threads;
+    double interval_ms;
+    double next_sample_ms = 0;
+    size_t depth = 0;
+    std::vector<sample> samples;
+    std::vector<depth_change> changes;
+
+public:
+    throughput_timeline(progress_counter const *c, int n, double interval_ms, size_t initial_depth)
+            : counters(c), num_threads(n), interval_ms(interval_ms), depth(initial_depth) {}
+
+    /* Called by the driver's main loop (about every millisecond) */
+    void poll(double now_ms, size_t current_depth) {
+        if (current_depth != depth) {
+            changes.push_back({now_ms, depth, current_depth});
+            depth = current_depth;
+        }
+        if (now_ms < next_sample_ms) return;
+        next_sample_ms += interval_ms;
+        sample s{now_ms, std::vector<uint64_t>(num_threads), depth};
+        for (int id = 0; id < num_threads; ++id)
+            s.ops[id] = counters[id].ops.load(std::memory_order_relaxed);
+        samples.push_back(s);
+    }
+
+    /* One row per interval: time, ops/sec of the interval, depth, ops per
+     * thread in the interval; depth changes and the end of the preload
+     * (run_start_ms) follow as comment lines. */
+    void write(std::string const &path, double run_start_ms) const {
+        std::ofstream outfile(path);
+        outfile << "Time ms, Ops per sec, Depth";
+        for (int id = 0; id < num_threads; ++id) outfile << ", Thread " << id << " ops";
+        outfile << std::endl;
+        for (size_t i = 1; i < samples.size(); ++i) {
+            sample const &prev = samples[i - 1], &cur = samples[i];
+            uint64_t interval_ops = 0;
+            for (int id = 0; id < num_threads; ++id) interval_ops += cur.ops[id] - prev.ops[id];
+            outfile << cur.time_ms << ", " << (uint64_t) (interval_ops * 1000.0 / (cur.time_ms - prev.time_ms))
+                    << ", " << cur.depth;
+            for (int id = 0; id < num_threads; ++id) outfile << ", " << cur.ops[id] - prev.ops[id];
+            outfile << std::endl;
+        }
+        outfile << "# run starts at " << run_start_ms << " ms" << std::endl;
+        for (depth_change const &c : changes)
+            outfile << "# depth " << c.from << " -> " << c.to << " at " << c.time_ms << " ms" << std::endl;
+    }
+};
+
+#endif //BENCH_TIMELINE_H
@@ -0,0 +1,500 @@
+#ifndef BENCH_WORKLOAD_H
+#define BENCH_WORKLOAD_H
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <pthread.h>
+#include <string>
+#include <unistd.h> // for usleep
+#include <vector>
+#include "timeline.h"
+#include "alloc_counter.h"
+#include "perf_counters.h"
+
+/*** YCSB style workloads for the benchmark drivers ***/
+/**@workload_spec - the operation mix and key distribution of one workload,
+ * ycsb_spec('A'..'F') gives the standard YCSB core workloads:
+ *  A 50% read 50% update, zipfian    B 95% read 5% update, zipfian
+ *  C 100% read, zipfian              D 95% read 5% insert, latest
+ *  E 95% scan 5% insert, zipfian     F 50% read 50% read-modify-write, zipfian
+ * None of the tables has a range scan, a scan is scan_length point reads of
+ * consecutive key ordinals.
+ * Keys are ordinals passed through a bijective mixer so that hot ordinals are
+ * spread over the hash space, as YCSB does with its hashed key names.
+ * **/
+
+enum ycsb_op {
+    YCSB_READ, YCSB_UPDATE, YCSB_INSERT, YCSB_SCAN, YCSB_RMW, NUM_OF_YCSB_OPS
+};
+
+enum key_distribution {
+    DIST_UNIFORM, DIST_ZIPFIAN, DIST_LATEST, DIST_HOTSPOT
+};
+
+inline const char *ycsb_op_name(int op) {
+    static const char *const names[NUM_OF_YCSB_OPS] = {"read", "update", "insert", "scan", "rmw"};
+    return names[op];
+}
+
+struct workload_spec {
+    char name;
+    double mix[NUM_OF_YCSB_OPS]; // fraction of each op, sums to 1
+    key_distribution distribution;
+};
+
+inline workload_spec ycsb_spec(char name) {
+    switch (name) {
+        case 'A': return {'A', {0.5, 0.5, 0, 0, 0}, DIST_ZIPFIAN};
+        case 'B': return {'B', {0.95, 0.05, 0, 0, 0}, DIST_ZIPFIAN};
+        case 'C': return {'C', {1, 0, 0, 0, 0}, DIST_ZIPFIAN};
+        case 'D': return {'D', {0.95, 0, 0.05, 0, 0}, DIST_LATEST};
+        case 'E': return {'E', {0, 0, 0.05, 0.95, 0}, DIST_ZIPFIAN};
+        case 'F': return {'F', {0.5, 0, 0, 0, 0.5}, DIST_ZIPFIAN};
+        default:
+            std::cerr << "Unknown workload " << name << ", expected A-F" << std::endl;
+            exit(1);
+    }
+}
+
+struct workload_options {
+    workload_spec spec = ycsb_spec('A');
+    int threads = 1;
+    double seconds = 10;
+    uint64_t records = 1000000;     // preloaded key population
+    double theta = 0.99;            // zipfian skew, 0 <= theta < 1
+    double hot_set_fraction = 0.2;  // hotspot: this fraction of the keys...
+    double hot_op_fraction = 0.8;   // ...receives this fraction of the ops
+    int scan_length = 10;
+    size_t value_size = 8;
+    double timeline_ms = 0;         // sampling interval of the timeline, 0 for none
+    double memory_ms = 0;           // sampling interval of the memory report, 0 for none
+    std::string record_path;        // record the run into this trace
+    std::string replay_path;        // replay this trace instead of running the mix
+    bool open_loop = false;         // replay at the recorded times
+    bool warm = false;              // insert the trace's keys before replaying it
+    bool threads_set = false;
+    bool perf = false;              // hardware counters per op
+};
+
+inline void print_workload_usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " [--workload=A-F] [--threads=n] [--seconds=s] [--records=n]\n"
+              << "    [--distribution=uniform|zipfian|latest|hotspot] [--theta=t] [--hot-set=f]\n"
+              << "    [--hot-ops=f] [--scan-length=n] [--value-size=8|16|64|256|1024|4096]\n"
+              << "    [--timeline=ms] [--memory=ms] [--record=trace]\n"
+              << "    [--replay=trace [--open-loop=1] [--warm=1]] [--perf=1]" << std::endl;
+}
+
+/* Parses --name=value arguments, unknown arguments are left for the driver */
+inline workload_options parse_workload_args(int argc, char *argv[]) {
+    workload_options opt;
+    bool distribution_set = false;
+    key_distribution distribution = DIST_ZIPFIAN;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        size_t eq = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) continue;
+        std::string name = arg.substr(2, eq - 2), value = arg.substr(eq + 1);
+        if (name == "workload") opt.spec = ycsb_spec(value[0]);
+        else if (name == "threads") {
+            opt.threads = atoi(value.c_str());
+            opt.threads_set = true;
+        }
+        else if (name == "seconds") opt.seconds = atof(value.c_str());
+        else if (name == "records") opt.records = strtoull(value.c_str(), nullptr, 10);
+        else if (name == "theta") opt.theta = atof(value.c_str());
+        else if (name == "hot-set") opt.hot_set_fraction = atof(value.c_str());
+        else if (name == "hot-ops") opt.hot_op_fraction = atof(value.c_str());
+        else if (name == "scan-length") opt.scan_length = atoi(value.c_str());
+        else if (name == "value-size") opt.value_size = strtoull(value.c_str(), nullptr, 10);
+        else if (name == "timeline") opt.timeline_ms = atof(value.c_str());
+        else if (name == "memory") opt.memory_ms = atof(value.c_str());
+        else if (name == "record") opt.record_path = value;
+        else if (name == "replay") opt.replay_path = value;
+        else if (name == "open-loop") opt.open_loop = value != "0";
+        else if (name == "warm") opt.warm = value != "0";
+        else if (name == "perf") opt.perf = value != "0";
+        else if (name == "distribution") {
+            distribution_set = true;
+            if (value == "uniform") distribution = DIST_UNIFORM;
+            else if (value == "zipfian") distribution = DIST_ZIPFIAN;
+            else if (value == "latest") distribution = DIST_LATEST;
+            else if (value == "hotspot") distribution = DIST_HOTSPOT;
+            else {
+                print_workload_usage(argv[0]);
+                exit(1);
+            }
+        }
+    }
+    if (distribution_set) opt.spec.distribution = distribution;
+    assert(0 <= opt.theta && opt.theta < 1 && opt.threads > 0 && opt.records > 0);
+    if (opt.memory_ms > 0 && !alloc_counting_available()) {
+        std::cerr << "--memory needs a driver compiled with -DBENCH_COUNT_ALLOCATIONS" << std::endl;
+        exit(1);
+    }
+    return opt;
+}
+
+/*** Random generators ***/
+
+// splitmix64 finalizer, a bijection on 64 bit words
+inline uint64_t mix64(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+inline uint64_t ordinal_to_key(uint64_t ordinal) {
+    return mix64(ordinal);
+}
+
+struct fast_rng {
+    uint64_t state;
+
+    explicit fast_rng(uint64_t seed) : state(mix64(seed + 1)) {}
+
+    uint64_t next() { // xorshift64*
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545f4914f6cdd1dULL;
+    }
+
+    double next_double() { // [0, 1)
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    uint64_t next_below(uint64_t n) {
+        return (uint64_t) (next_double() * n);
+    }
+};
+
+/* Gray et al. "Quickly generating billion-record synthetic databases", as in
+ * YCSB's ZipfianGenerator. Returns ordinals in [0, n), 0 is the most popular. */
+class zipfian_generator {
+    uint64_t n;
+    double theta, alpha, zetan, eta, half_pow_theta;
+
+    static double zeta(uint64_t n, double theta) {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; ++i)
+            sum += 1.0 / std::pow((double) i, theta);
+        return sum;
+    }
+
+public:
+    zipfian_generator(uint64_t n, double theta) : n(n), theta(theta) {
+        zetan = zeta(n, theta);
+        double zeta2 = zeta(2, theta);
+        alpha = 1.0 / (1.0 - theta);
+        eta = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+        half_pow_theta = 1 + std::pow(0.5, theta);
+    }
+
+    uint64_t next(fast_rng &rng) const {
+        double u = rng.next_double();
+        double uz = u * zetan;
+        if (uz < 1) return 0;
+        if (uz < half_pow_theta) return 1;
+        uint64_t res = (uint64_t) (n * std::pow(eta * u - eta + 1, alpha));
+        return res < n ? res : n - 1;
+    }
+};
+
+/* Chooses the ordinal of the next key to read/update, shared by all threads */
+class key_chooser {
+    workload_options const &opt;
+    zipfian_generator zipf;
+
+public:
+    std::atomic<uint64_t> inserted; // ordinals [0, inserted) exist
+
+    explicit key_chooser(workload_options const &o)
+            : opt(o),
+              // zeta(records) is O(records), only pay for it when it is used
+              zipf(o.spec.distribution == DIST_ZIPFIAN || o.spec.distribution == DIST_LATEST ? o.records : 2, o.theta),
+              inserted(o.records) {}
+
+    uint64_t next(fast_rng &rng) const {
+        uint64_t count = inserted.load(std::memory_order_relaxed);
+        switch (opt.spec.distribution) {
+            case DIST_UNIFORM:
+                return rng.next_below(count);
+            case DIST_ZIPFIAN:
+                return zipf.next(rng);
+            case DIST_LATEST: {
+                uint64_t back = zipf.next(rng);
+                return back < count ? count - 1 - back : 0;
+            }
+            case DIST_HOTSPOT: {
+                uint64_t hot = (uint64_t) (count * opt.hot_set_fraction);
+                if (hot == 0) hot = 1;
+                if (rng.next_double() < opt.hot_op_fraction || hot == count)
+                    return rng.next_below(hot);
+                return hot + rng.next_below(count - hot);
+            }
+        }
+        return 0;
+    }
+
+    uint64_t next_insert() {
+        return inserted.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+/*** Values of a configurable size ***/
+
+template<size_t N>
+struct bench_value {
+    uint8_t bytes[N];
+
+    bench_value() : bytes() {}
+
+    explicit bench_value(uint64_t seed) {
+        for (size_t i = 0; i < N; ++i) bytes[i] = (uint8_t) (seed >> (8 * (i % 8)));
+    }
+};
+
+/*** The runner ***/
+/**@Adapter - wraps one table implementation:
+ *  typedef ... value_type;
+ *  void insert(uint64_t key, value_type const &value, int thread_id);
+ *  bool read(uint64_t key, value_type &out, int thread_id);
+ *  bool remove(uint64_t key, int thread_id);
+ * and optionally size_t depth(), the directory depth shown on the timeline,
+ * size_t reachable_bytes(), the memory reachable from the table's root, and
+ * int max_threads(), the number of thread ids it accepts.
+ * **/
+
+// The thread ids tables that expose max_threads() accept, INT_MAX for the others
+template<typename Table>
+auto table_max_threads(Table &t, int) -> decltype((int) t.max_threads()) {
+    return t.max_threads();
+}
+
+template<typename Table>
+int table_max_threads(Table &, long) {
+    return INT_MAX;
+}
+
+struct workload_thread_result {
+    uint64_t ops[NUM_OF_YCSB_OPS];
+    uint64_t found;
+    perf_values perf; // of the run phase only
+};
+
+template<typename Adapter>
+struct workload_thread_data {
+    int thread_id;
+    Adapter *table;
+    workload_options const *opt;
+    key_chooser *keys;
+    std::atomic<bool> *start;
+    std::atomic<bool> *stop;
+    std::atomic<int> *loaded;
+    progress_counter *progress;
+    workload_thread_result result;
+};
+
+template<typename Adapter>
+void *workload_thread_function(void *threadarg) {
+    typedef typename Adapter::value_type value_type;
+    workload_thread_data<Adapter> *params = (workload_thread_data<Adapter> *) threadarg;
+    Adapter &table = *(params->table);
+    workload_options const &opt = *(params->opt);
+    int id = params->thread_id;
+    fast_rng rng(id);
+    value_type value(id), out;
+    thread_perf_counters perf;
+    if (opt.perf) perf.open();
+
+    // preload this thread's share of the records
+    for (uint64_t ord = id; ord < opt.records; ord += opt.threads) {
+        table.insert(ordinal_to_key(ord), value_type(ord), id);
+        params->progress->add();
+    }
+    params->loaded->fetch_add(1);
+
+    while (!params->start->load(std::memory_order_acquire));
+    if (opt.perf) perf.start();
+    double cumulative[NUM_OF_YCSB_OPS];
+    double sum = 0;
+    for (int op = 0; op < NUM_OF_YCSB_OPS; ++op) cumulative[op] = (sum += opt.spec.mix[op]);
+
+    while (!params->stop->load(std::memory_order_relaxed)) {
+        double r = rng.next_double() * sum;
+        int op = 0;
+        while (op < NUM_OF_YCSB_OPS - 1 && r >= cumulative[op]) ++op;
+        switch (op) {
+            case YCSB_READ:
+                params->result.found += table.read(ordinal_to_key(params->keys->next(rng)), out, id);
+                break;
+            case YCSB_UPDATE:
+                table.insert(ordinal_to_key(params->keys->next(rng)), value, id);
+                break;
+            case YCSB_INSERT:
+                table.insert(ordinal_to_key(params->keys->next_insert()), value, id);
+                break;
+            case YCSB_SCAN: {
+                uint64_t start = params->keys->next(rng);
+                for (int i = 0; i < opt.scan_length; ++i)
+                    params->result.found += table.read(ordinal_to_key(start + i), out, id);
+                break;
+            }
+            case YCSB_RMW: {
+                uint64_t key = ordinal_to_key(params->keys->next(rng));
+                params->result.found += table.read(key, out, id);
+                table.insert(key, value, id);
+                break;
+            }
+        }
+        params->result.ops[op]++;
+        params->progress->add();
+    }
+    if (opt.perf) {
+        perf.stop();
+        params->result.perf = perf.read_values();
+    }
+    pthread_exit(nullptr);
+    return nullptr;
+}
+
+/* Preloads opt.records keys, runs the mix on opt.threads threads for
+ * opt.seconds, prints a summary and writes per thread results to
+ * ycsb_<table_name>_<workload>_threads_<n>. With opt.timeline_ms the
+ * throughput of the preload and the run over time goes to
+ * timeline_<table_name>_<workload>_threads_<n>, with opt.memory_ms the
+ * memory use goes to memory_<table_name>_<workload>_records_<n>.
+ * Returns the total op count. */
+template<typename Adapter>
+uint64_t run_workload(Adapter &table, workload_options const &opt, std::string const &table_name) {
+    key_chooser keys(opt);
+    std::atomic<bool> start(false), stop(false);
+    std::atomic<int> loaded(0);
+    std::vector<pthread_t> threads(opt.threads);
+    std::vector<workload_thread_data<Adapter>> td(opt.threads);
+    std::vector<progress_counter> progress(opt.threads);
+    throughput_timeline timeline(progress.data(), opt.threads, opt.timeline_ms, table_depth(table, 0));
+    auto created = std::chrono::steady_clock::now();
+    memory_report memory;
+    double next_memory_ms = 0;
+    auto poll_timeline = [&]() {
+        double now_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - created).count();
+        if (opt.timeline_ms > 0)
+            timeline.poll(now_ms, table_depth(table, 0));
+        if (opt.memory_ms > 0 && now_ms >= next_memory_ms) {
+            next_memory_ms += opt.memory_ms;
+            memory.poll(now_ms, table_reachable_bytes(table, 0));
+        }
+    };
+    memory.load_started();
+
+    for (int id = 0; id < opt.threads; ++id) {
+        td[id] = {id, &table, &opt, &keys, &start, &stop, &loaded, &progress[id], {}};
+        int rc = pthread_create(&threads[id], nullptr, workload_thread_function<Adapter>, (void *) &td[id]);
+        assert(rc == 0); // Error: unable to create thread
+    }
+    while (loaded.load() < opt.threads) {
+        usleep(opt.timeline_ms > 0 || opt.memory_ms > 0 ? 1000 : 100);
+        poll_timeline();
+    }
+    memory.load_done(opt.records);
+
+    auto begin = std::chrono::steady_clock::now();
+    start.store(true, std::memory_order_release);
+    while (std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count() < opt.seconds) {
+        usleep(1000);
+        poll_timeline();
+    }
+    stop.store(true);
+    for (int id = 0; id < opt.threads; ++id)
+        pthread_join(threads[id], nullptr);
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    if (opt.memory_ms > 0) poll_timeline();
+
+    uint64_t total = 0, found = 0, reads = 0;
+    perf_values perf;
+    std::ofstream outfile("ycsb_" + table_name + "_" + opt.spec.name + "_threads_" + std::to_string(opt.threads));
+    outfile << "Thread ID";
+    for (int op = 0; op < NUM_OF_YCSB_OPS; ++op) outfile << ", Number of " << ycsb_op_name(op) << " ops";
+    outfile << std::endl;
+    for (int id = 0; id < opt.threads; ++id) {
+        outfile << id;
+        for (int op = 0; op < NUM_OF_YCSB_OPS; ++op) {
+            outfile << ", " << td[id].result.ops[op];
+            total += td[id].result.ops[op];
+        }
+        outfile << std::endl;
+        found += td[id].result.found;
+        perf.add(td[id].result.perf);
+        reads += td[id].result.ops[YCSB_READ] + td[id].result.ops[YCSB_RMW]
+                 + td[id].result.ops[YCSB_SCAN] * opt.scan_length;
+    }
+    if (opt.timeline_ms > 0)
+        timeline.write("timeline_" + table_name + "_" + opt.spec.name + "_threads_" + std::to_string(opt.threads),
+                       std::chrono::duration<double, std::milli>(begin - created).count());
+    std::cout << table_name << " workload " << opt.spec.name << ", " << opt.threads << " threads, "
+              << opt.records << " records, value size " << opt.value_size << ": "
+              << (uint64_t) (total / elapsed) << " ops/sec, read hit rate "
+              << (reads ? (double) found / reads : 0) << std::endl;
+    if (opt.perf) {
+        perf.print_per_op(std::cout, total);
+        perf.print_per_op(outfile, total);
+    }
+    if (opt.memory_ms > 0) {
+        memory.run_done(total);
+        memory.print_summary(std::cout, opt.records);
+        memory.write("memory_" + table_name + "_" + opt.spec.name + "_records_" + std::to_string(opt.records),
+                     table_name + " workload " + opt.spec.name + ", " + std::to_string(opt.threads) + " threads, value size "
+                     + std::to_string(opt.value_size), opt.records);
+    }
+    return total;
+}
+
+#include "replay.h"
+
+/* What the drivers call: replays a trace, or runs the mix (recording it) */
+template<typename Adapter>
+uint64_t run_benchmark(Adapter &table, workload_options const &opt, std::string const &table_name) {
+    int const max_threads = table_max_threads(table, 0);
+    if (opt.threads > max_threads) {
+        std::cerr << table_name << " takes at most " << max_threads << " threads" << std::endl;
+        exit(1);
+    }
+    if (!opt.replay_path.empty())
+        return run_replay(table, opt, table_name, max_threads);
+    if (opt.record_path.empty())
+        return run_workload(table, opt, table_name);
+    trace_recorder recorder(opt.record_path);
+    if (!recorder.IsOpen()) {
+        std::cerr << "Can't write trace: " << opt.record_path << std::endl;
+        exit(1);
+    }
+    recording_adapter<Adapter> recording{table, recorder};
+    return run_workload(recording, opt, table_name);
+}
+
+/* Instantiates Runner::template run<bench_value<N>>() for opt.value_size */
+template<typename Runner>
+void dispatch_value_size(Runner &runner, size_t value_size) {
+    switch (value_size) {
+        case 8: runner.template run<bench_value<8>>(); break;
+        case 16: runner.template run<bench_value<16>>(); break;
+        case 64: runner.template run<bench_value<64>>(); break;
+        case 256: runner.template run<bench_value<256>>(); break;
+        case 1024: runner.template run<bench_value<1024>>(); break;
+        case 4096: runner.template run<bench_value<4096>>(); break;
+        default:
+            std::cerr << "Unsupported value size " << value_size << std::endl;
+            exit(1);
+    }
+}
+
+#endif //BENCH_WORKLOAD_H
@@ -8,6 +8,7 @@
 #include <atomic>
 #include <cassert>
 #include "libcuckoo/libcuckoo/cuckoohash_map.hh"
+#include "../common/workload.h"
 
 #define MAX_ELEMENTS_PER_THREAD_FOR_COMFORT_TEST (1000000)
 #define KEY(id, k) (id * MAX_ELEMENTS_PER_THREAD_FOR_COMFORT_TEST + k)
@@ -79,7 +80,40 @@ void benchmark_libcukoo(int n_threads) {
     }
 }
 
-int main() {
+template<typename V>
+struct libcukoo_adapter {
+    typedef V value_type;
+    libcuckoo::cuckoohash_map<uint64_t, V> m;
+
+    void insert(uint64_t key, V const &value, int) {
+        m.insert_or_assign(key, value);
+    }
+
+    bool read(uint64_t key, V &out, int) {
+        return m.find(key, out);
+    }
+
+    bool remove(uint64_t key, int) {
+        return m.erase(key);
+    }
+};
+
+struct libcukoo_runner {
+    workload_options opt;
+
+    template<typename V>
+    void run() {
+        libcukoo_adapter<V> table;
+        run_benchmark(table, opt, "libcukoo");
+    }
+};
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) { // YCSB style workload, see ../common/workload.h
+        libcukoo_runner runner{parse_workload_args(argc, argv)};
+        dispatch_value_size(runner, runner.opt.value_size);
+        return 0;
+    }
     int n_threads;
 
     std::cout << "Please enter the amount of HW thread this machine supports:" << std::endl;
@@ -91,4 +125,4 @@ int main() {
     }
     std::cout << "Done all tests" << std::endl;
     return 0;
-}
\ No newline at end of file
+}
\ No newline at end of file
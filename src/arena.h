@@ -0,0 +1,166 @@
+#ifndef EWRHT_ARENA_H
+#define EWRHT_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+#include <sys/mman.h>
+
+#define ARENA_CHUNK_SIZE ((size_t) 2 << 20) // a huge page
+#define ARENA_BATCH (32) // blocks moved between a thread and the central list at once
+
+/*** Huge page arena, compiled in with -DHASHMAP_HUGE_PAGES ***/
+/**@MapHugePages - maps a multiple of ARENA_CHUNK_SIZE bytes, aligned to it, from
+ * the reserved huge pages (MAP_HUGETLB) when there are some, else as normal
+ * memory advised to transparent huge pages (MADV_HUGEPAGE), which the kernel
+ * backs with 2 MB pages when it can and with 4 KB pages otherwise.
+ * @hashmap_block_pool<BlockSize> - blocks of one size carved from such chunks.
+ * A thread carves from its own chunk and reuses the blocks it frees; a thread
+ * that frees much more than it allocates passes batches of ARENA_BATCH blocks
+ * to a central list, where the others pick them up, and so does a thread that
+ * exits. Chunks are never unmapped.
+ * @hashmap_arena_allocator<T> - an Allocator over the pools, for
+ * std::allocate_shared, so a node and its control block share one block.
+ * **/
+
+inline void *MapHugePages(size_t const bytes) {
+    void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) return p;
+    // no reserved huge pages, map with room to align and trim the ends
+    size_t const padded = bytes + ARENA_CHUNK_SIZE;
+    char *raw = static_cast<char *>(mmap(nullptr, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (raw == MAP_FAILED) throw std::bad_alloc();
+    char *aligned = reinterpret_cast<char *>(
+            (reinterpret_cast<uintptr_t>(raw) + ARENA_CHUNK_SIZE - 1) & ~(uintptr_t) (ARENA_CHUNK_SIZE - 1));
+    if (aligned != raw) munmap(raw, aligned - raw);
+    if (aligned + bytes != raw + padded) munmap(aligned + bytes, raw + padded - (aligned + bytes));
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, bytes, MADV_HUGEPAGE);
+#endif
+    return aligned;
+}
+
+inline void UnmapHugePages(void *p, size_t const bytes) {
+    munmap(p, bytes);
+}
+
+template<size_t BlockSize>
+class hashmap_block_pool {
+    static_assert(BlockSize % 64 == 0 && BlockSize <= ARENA_CHUNK_SIZE, "blocks are whole cache lines of a chunk");
+
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+    struct Central {
+        std::mutex lock;
+        std::vector<std::pair<FreeBlock *, size_t>> batches; // lists of blocks and their lengths
+    };
+
+    struct ThreadCache {
+        FreeBlock *free = nullptr;
+        size_t free_count = 0;
+        char *next = nullptr, *end = nullptr; // the rest of this thread's chunk
+
+        ~ThreadCache() { // an exiting thread hands its free blocks over, the rest of its chunk is lost
+            if (!free) return;
+            Central &central = Shared();
+            std::lock_guard<std::mutex> guard(central.lock);
+            central.batches.emplace_back(free, free_count);
+        }
+    };
+
+    static ThreadCache &Cache() {
+        thread_local ThreadCache cache;
+        return cache;
+    }
+
+    static Central &Shared() {
+        static Central central;
+        return central;
+    }
+
+public:
+    static void *Allocate() {
+        ThreadCache &c = Cache();
+        if (!c.free) {
+            Central &central = Shared();
+            std::lock_guard<std::mutex> guard(central.lock);
+            if (!central.batches.empty()) {
+                c.free = central.batches.back().first;
+                c.free_count = central.batches.back().second;
+                central.batches.pop_back();
+            }
+        }
+        if (c.free) {
+            FreeBlock *b = c.free;
+            c.free = b->next;
+            --c.free_count;
+            return b;
+        }
+        if (c.next == c.end) {
+            c.next = static_cast<char *>(MapHugePages(ARENA_CHUNK_SIZE));
+            c.end = c.next + ARENA_CHUNK_SIZE / BlockSize * BlockSize;
+        }
+        void *p = c.next;
+        c.next += BlockSize;
+        return p;
+    }
+
+    static void Deallocate(void *p) {
+        ThreadCache &c = Cache();
+        FreeBlock *b = static_cast<FreeBlock *>(p);
+        b->next = c.free;
+        c.free = b;
+        if (++c.free_count < 2 * ARENA_BATCH) return;
+        FreeBlock *batch = c.free, *last = c.free; // hand the newest ARENA_BATCH blocks to the others
+        for (int i = 1; i < ARENA_BATCH; ++i) last = last->next;
+        c.free = last->next;
+        last->next = nullptr;
+        c.free_count -= ARENA_BATCH;
+        Central &central = Shared();
+        std::lock_guard<std::mutex> guard(central.lock);
+        central.batches.emplace_back(batch, ARENA_BATCH);
+    }
+};
+
+template<typename T>
+struct hashmap_arena_allocator {
+    typedef T value_type;
+    static constexpr size_t block_size = (sizeof(T) + 63) / 64 * 64;
+    static constexpr bool pooled = alignof(T) <= 64 && block_size <= ARENA_CHUNK_SIZE;
+
+    hashmap_arena_allocator() = default;
+
+    template<typename U>
+    hashmap_arena_allocator(hashmap_arena_allocator<U> const &) {}
+
+    T *allocate(size_t const n) {
+        if constexpr (pooled) {
+            if (n == 1) return static_cast<T *>(hashmap_block_pool<block_size>::Allocate());
+        }
+        return static_cast<T *>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, size_t const n) {
+        if constexpr (pooled) {
+            if (n == 1) return hashmap_block_pool<block_size>::Deallocate(p);
+        }
+        ::operator delete(p);
+    }
+
+    template<typename U>
+    bool operator==(hashmap_arena_allocator<U> const &) const {
+        return true;
+    }
+
+    template<typename U>
+    bool operator!=(hashmap_arena_allocator<U> const &) const {
+        return false;
+    }
+};
+
+#endif //EWRHT_ARENA_H
@@ -0,0 +1,146 @@
+#ifndef EWRHT_BYTE_KEY_H
+#define EWRHT_BYTE_KEY_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+#define BYTE_KEY_INLINE (15)
+#define BYTE_KEY_OUT_OF_LINE (0xFF)
+
+/*** Variable length keys ***/
+/**@byte_key - an immutable byte string used as a hashmap Key. Keys of up to
+ * BYTE_KEY_INLINE bytes live inside the 16 byte handle, longer ones in a
+ * refcounted blob that every copy of the key shares. Copying a BState then
+ * copies handles (and bumps refcounts) instead of the key bytes.
+ * bytes[BYTE_KEY_INLINE] holds the inline length, or BYTE_KEY_OUT_OF_LINE when
+ * the first 8 bytes hold the Blob pointer.
+ * **/
+class byte_key {
+    struct Blob {
+        std::atomic<uint32_t> refs;
+        uint32_t size;
+
+        char *Data() {
+            return reinterpret_cast<char *>(this + 1);
+        }
+    };
+
+    char bytes[BYTE_KEY_INLINE + 1];
+
+    bool IsInline() const {
+        return (uint8_t) bytes[BYTE_KEY_INLINE] != BYTE_KEY_OUT_OF_LINE;
+    }
+
+    Blob *GetBlob() const {
+        Blob *b;
+        memcpy(&b, bytes, sizeof(b));
+        return b;
+    }
+
+    void SetBlob(Blob *b) {
+        memcpy(bytes, &b, sizeof(b));
+        bytes[BYTE_KEY_INLINE] = (char) BYTE_KEY_OUT_OF_LINE;
+    }
+
+    void Assign(const void *data, size_t size) {
+        if (size <= BYTE_KEY_INLINE) {
+            memcpy(bytes, data, size);
+            bytes[BYTE_KEY_INLINE] = (char) size;
+            return;
+        }
+        Blob *b = static_cast<Blob *>(::operator new(sizeof(Blob) + size));
+        new(&b->refs) std::atomic<uint32_t>(1);
+        b->size = (uint32_t) size;
+        memcpy(b->Data(), data, size);
+        SetBlob(b);
+    }
+
+    void Release() {
+        if (IsInline()) return;
+        Blob *b = GetBlob();
+        if (b->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            ::operator delete(b);
+    }
+
+public:
+    byte_key() : bytes() {}
+
+    byte_key(const void *data, size_t size) : bytes() {
+        Assign(data, size);
+    }
+
+    byte_key(const char *s) : byte_key(s, strlen(s)) {}
+
+    byte_key(std::string_view s) : byte_key(s.data(), s.size()) {}
+
+    byte_key(std::string const &s) : byte_key(s.data(), s.size()) {}
+
+    byte_key(byte_key const &k) {
+        memcpy(bytes, k.bytes, sizeof(bytes));
+        if (!IsInline()) GetBlob()->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    byte_key(byte_key &&k) noexcept {
+        memcpy(bytes, k.bytes, sizeof(bytes));
+        k.bytes[BYTE_KEY_INLINE] = 0; // k is now the empty inline key
+    }
+
+    byte_key &operator=(byte_key const &k) {
+        if (this != &k) {
+            byte_key temp(k);
+            *this = std::move(temp);
+        }
+        return *this;
+    }
+
+    byte_key &operator=(byte_key &&k) noexcept {
+        if (this != &k) {
+            Release();
+            memcpy(bytes, k.bytes, sizeof(bytes));
+            k.bytes[BYTE_KEY_INLINE] = 0;
+        }
+        return *this;
+    }
+
+    ~byte_key() {
+        Release();
+    }
+
+    const char *data() const {
+        return IsInline() ? bytes : GetBlob()->Data();
+    }
+
+    size_t size() const {
+        return IsInline() ? (size_t) bytes[BYTE_KEY_INLINE] : GetBlob()->size;
+    }
+
+    std::string_view view() const {
+        return {data(), size()};
+    }
+
+    // Equal lengths always use the same storage, so a shared blob is a match
+    bool operator==(byte_key const &k) const {
+        if (IsInline() != k.IsInline()) return false;
+        if (IsInline())
+            return bytes[BYTE_KEY_INLINE] == k.bytes[BYTE_KEY_INLINE] && memcmp(bytes, k.bytes, size()) == 0;
+        Blob *a = GetBlob(), *b = k.GetBlob();
+        return a == b || (a->size == b->size && memcmp(a->Data(), b->Data(), a->size) == 0);
+    }
+
+    bool operator!=(byte_key const &k) const {
+        return !(*this == k);
+    }
+};
+
+static_assert(sizeof(byte_key) == BYTE_KEY_INLINE + 1, "byte_key is a 16 byte handle");
+
+inline std::ostream &operator<<(std::ostream &os, byte_key const &k) {
+    return os << k.view();
+}
+
+#endif //EWRHT_BYTE_KEY_H
@@ -0,0 +1,132 @@
+#ifndef EWRHT_HASH_BATCH_H
+#define EWRHT_HASH_BATCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "xxhash/include/xxhash.hpp"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define HASH_BATCH_X86 (1)
+#endif
+
+/*** Batch hashing of 4 and 8 byte keys ***/
+/**xxhash32_batch<Size>(keys, n, out) sets out[i] to xxh::xxhash<32> (seed 0)
+ * of the Size bytes at keys + i * Size, bit for bit. Keys of 4 and 8 bytes
+ * take the short input path of xxhash32 only (a round per 4 bytes and the
+ * avalanche), which is all 32 bit multiplies, rotates and xors, so the lanes
+ * of a vector hash a key each: 16 keys per step with AVX-512, 8 with AVX2,
+ * chosen at run time, and the scalar xxhash for the rest of the batch and on
+ * other CPUs.
+ * **/
+
+#define XXH32_PRIME_1 (2654435761U)
+#define XXH32_PRIME_2 (2246822519U)
+#define XXH32_PRIME_3 (3266489917U)
+#define XXH32_PRIME_4 (668265263U)
+#define XXH32_PRIME_5 (374761393U)
+
+#ifdef HASH_BATCH_X86
+
+__attribute__((target("avx2")))
+inline __m256i Xxh32RoundAvx2(__m256i h, __m256i k) {
+    h = _mm256_add_epi32(h, _mm256_mullo_epi32(k, _mm256_set1_epi32((int) XXH32_PRIME_3)));
+    h = _mm256_or_si256(_mm256_slli_epi32(h, 17), _mm256_srli_epi32(h, 32 - 17));
+    return _mm256_mullo_epi32(h, _mm256_set1_epi32((int) XXH32_PRIME_4));
+}
+
+__attribute__((target("avx2")))
+inline __m256i Xxh32AvalancheAvx2(__m256i h) {
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 15));
+    h = _mm256_mullo_epi32(h, _mm256_set1_epi32((int) XXH32_PRIME_2));
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+    h = _mm256_mullo_epi32(h, _mm256_set1_epi32((int) XXH32_PRIME_3));
+    return _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+}
+
+// Hashes the first n - n % 8 keys, returns how many it did
+template<size_t Size>
+__attribute__((target("avx2")))
+size_t Xxh32BatchAvx2(const uint8_t *keys, size_t const n, uint32_t *out) {
+    __m256i const seed = _mm256_set1_epi32((int) (XXH32_PRIME_5 + Size));
+    __m256i const deinterleave = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i h;
+        if constexpr (Size == 4) {
+            h = Xxh32RoundAvx2(seed, _mm256_loadu_si256((__m256i const *) (keys + i * 4)));
+        } else { // low and high halves of keys 0-3 and of 4-7, then all lows and all highs
+            __m256i const a = _mm256_permutevar8x32_epi32(
+                    _mm256_loadu_si256((__m256i const *) (keys + i * 8)), deinterleave);
+            __m256i const b = _mm256_permutevar8x32_epi32(
+                    _mm256_loadu_si256((__m256i const *) (keys + i * 8 + 32)), deinterleave);
+            h = Xxh32RoundAvx2(seed, _mm256_permute2x128_si256(a, b, 0x20));
+            h = Xxh32RoundAvx2(h, _mm256_permute2x128_si256(a, b, 0x31));
+        }
+        _mm256_storeu_si256((__m256i *) (out + i), Xxh32AvalancheAvx2(h));
+    }
+    return i;
+}
+
+// The shifts and rotates below are the zero-masking forms under a full mask:
+// the plain intrinsics merge into an undefined vector, which GCC reports as
+// maybe uninitialized, and the instructions are the same
+#define XXH32_LANES_16 ((__mmask16) 0xFFFF)
+
+__attribute__((target("avx512f")))
+inline __m512i Xxh32RoundAvx512(__m512i h, __m512i k) {
+    h = _mm512_add_epi32(h, _mm512_mullo_epi32(k, _mm512_set1_epi32((int) XXH32_PRIME_3)));
+    return _mm512_mullo_epi32(_mm512_maskz_rol_epi32(XXH32_LANES_16, h, 17), _mm512_set1_epi32((int) XXH32_PRIME_4));
+}
+
+__attribute__((target("avx512f")))
+inline __m512i Xxh32AvalancheAvx512(__m512i h) {
+    h = _mm512_xor_si512(h, _mm512_maskz_srli_epi32(XXH32_LANES_16, h, 15));
+    h = _mm512_mullo_epi32(h, _mm512_set1_epi32((int) XXH32_PRIME_2));
+    h = _mm512_xor_si512(h, _mm512_maskz_srli_epi32(XXH32_LANES_16, h, 13));
+    h = _mm512_mullo_epi32(h, _mm512_set1_epi32((int) XXH32_PRIME_3));
+    return _mm512_xor_si512(h, _mm512_maskz_srli_epi32(XXH32_LANES_16, h, 16));
+}
+
+// Hashes the first n - n % 16 keys, returns how many it did
+template<size_t Size>
+__attribute__((target("avx512f")))
+size_t Xxh32BatchAvx512(const uint8_t *keys, size_t const n, uint32_t *out) {
+    __m512i const seed = _mm512_set1_epi32((int) (XXH32_PRIME_5 + Size));
+    __m512i const lows = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+    __m512i const highs = _mm512_setr_epi32(1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i h;
+        if constexpr (Size == 4) {
+            h = Xxh32RoundAvx512(seed, _mm512_loadu_si512(keys + i * 4));
+        } else {
+            __m512i const a = _mm512_loadu_si512(keys + i * 8), b = _mm512_loadu_si512(keys + i * 8 + 64);
+            h = Xxh32RoundAvx512(seed, _mm512_permutex2var_epi32(a, lows, b));
+            h = Xxh32RoundAvx512(h, _mm512_permutex2var_epi32(a, highs, b));
+        }
+        _mm512_storeu_si512(out + i, Xxh32AvalancheAvx512(h));
+    }
+    return i;
+}
+
+#endif
+
+template<size_t Size>
+void xxhash32_batch(const void *keys, size_t const n, xxh::hash_t<32> *out) {
+    static_assert(Size == 4 || Size == 8, "the batch kernels hash 4 and 8 byte keys");
+    static_assert(sizeof(xxh::hash_t<32>) == sizeof(uint32_t), "out is written as uint32_t lanes");
+    const uint8_t *bytes = static_cast<const uint8_t *>(keys);
+    size_t done = 0;
+#ifdef HASH_BATCH_X86
+    if (__builtin_cpu_supports("avx512f"))
+        done = Xxh32BatchAvx512<Size>(bytes, n, out);
+    else if (__builtin_cpu_supports("avx2"))
+        done = Xxh32BatchAvx2<Size>(bytes, n, out);
+#endif
+    for (size_t i = done; i < n; ++i)
+        out[i] = xxh::xxhash<32>(bytes + i * Size, Size);
+}
+
+#endif //EWRHT_HASH_BATCH_H
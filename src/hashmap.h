@@ -8,12 +8,44 @@
 #define BIGWORD_SIZE (16 * 8)
 #define POW(exp) ((unsigned)1 << (unsigned)(exp))
 #define SIZE_OF_HASH (32)
+#define INDIRECT_VALUE_SIZE (64) // bigger Values are stored out of line by default
+#define SUBMIT_QUEUE_SIZE (8) // submitted ops a thread id may have outstanding
+#define LOOKUP_BATCH_SIZE (16) // keys lookup_batch walks through the levels together
+#ifndef FAST_PATH_ATTEMPTS
+#define FAST_PATH_ATTEMPTS (2) // copy-and-CAS rounds an op tries before it announces itself, 0 always announces
+#endif
+#ifndef DELTA_CHAIN_LENGTH
+#define DELTA_CHAIN_LENGTH (0) // writes a bucket delta holds before a new base state, 0 copies the state per write
+#endif
 
 #include <iostream> // for debugging
 #include <cassert>
 #include <memory>
+#include <atomic>
+#include <cstdint>
 #include <bitset> // TODO using for the print only
+#include <chrono>
+#include <string>
+#include <functional>
+#include <optional>
+#include <algorithm>
+#include <deque>
+#include <future>
+#include <type_traits>
+#include <utility>
+#include <vector>
 #include "xxhash/include/xxhash.hpp"
+#include "byte_key.h"
+#include "hash_batch.h"
+
+#ifdef HASHMAP_HUGE_PAGES
+#include "arena.h"
+#endif
+
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+#include <coroutine>
+#define HASHMAP_COROUTINES (1)
+#endif
 
 using std::shared_ptr;
 using std::make_shared;
@@ -21,44 +53,395 @@ using std::atomic_compare_exchange_weak;
 using std::atomic_store;
 using std::atomic_load;
 
+/*** Statistics section goes below: ***/
+/**@Stat_type - the events counted by a hashmap_stats policy.
+ * STAT_MAKEOP_LOOPS - iterations of the MakeOp retry loop.
+ * STAT_HELPED - operations of other threads that this thread completed.
+ * STAT_RESIZE / STAT_RESIZE_SWAP - ResizeWF calls / successful swaps of ht.
+ * STAT_BSTATE_BYTES - bytes of bucket states (BState, BDelta) allocated.
+ * STAT_FAST_PATH - operations completed on the fast path, without announcing.
+ * **/
+enum Stat_type {
+    STAT_INSERT, STAT_REMOVE, STAT_LOOKUP,
+    STAT_MAKEOP_LOOPS, STAT_CAS_SUCCESS, STAT_CAS_FAILURE, STAT_HELPED,
+    STAT_RESIZE, STAT_RESIZE_SWAP, STAT_SPLIT_BUCKET, STAT_ENLARGE_DIR,
+    STAT_BSTATE_BYTES, STAT_FAST_PATH,
+    NUM_OF_STATS
+};
+
+inline const char *StatName(Stat_type s) {
+    static const char *const names[NUM_OF_STATS] = {
+            "insert", "remove", "lookup",
+            "makeop_loops", "cas_success", "cas_failure", "helped",
+            "resize", "resize_swap", "split_bucket", "enlarge_dir",
+            "bstate_bytes", "fast_path"
+    };
+    return names[s];
+}
+
+struct hashmap_stats_snapshot {
+    uint64_t count[NUM_OF_STATS]{};
+
+    uint64_t operator[](Stat_type s) const {
+        return count[s];
+    }
+
+    void Print(std::ostream &os) const {
+        for (int s = 0; s < NUM_OF_STATS; ++s)
+            os << StatName((Stat_type) s) << ": " << count[s] << std::endl;
+    }
+};
+
+// Default policy - every hook is empty so the counters compile to nothing.
+struct hashmap_no_stats {
+    static constexpr bool enabled = false;
+
+    void Add(unsigned int, Stat_type, uint64_t = 1) {}
+
+    hashmap_stats_snapshot Snapshot() const {
+        return {};
+    }
+};
+
+// Per-thread counters, each thread only writes its own slot (indexed by the
+// same id as insert/remove) and stats() sums the slots on demand.
+struct hashmap_stats {
+    static constexpr bool enabled = true;
+
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> count[NUM_OF_STATS];
+    };
+
+    Slot slots[NUMBER_OF_THREADS];
+
+    hashmap_stats() {
+        for (Slot &slot : slots)
+            for (std::atomic<uint64_t> &c : slot.count)
+                c.store(0, std::memory_order_relaxed);
+    }
+
+    void Add(unsigned int id, Stat_type s, uint64_t n = 1) {
+        slots[id].count[s].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    hashmap_stats_snapshot Snapshot() const {
+        hashmap_stats_snapshot res;
+        for (Slot const &slot : slots)
+            for (int s = 0; s < NUM_OF_STATS; ++s)
+                res.count[s] += slot.count[s].load(std::memory_order_relaxed);
+        return res;
+    }
+
+    // lookup() has no thread id, so give every calling thread a fixed slot
+    static unsigned int LocalSlot() {
+        static std::atomic<unsigned int> next{0};
+        thread_local unsigned int slot = next.fetch_add(1, std::memory_order_relaxed) % NUMBER_OF_THREADS;
+        return slot;
+    }
+};
+
+/*** Structure introspection, filled by hashmap::layout_report(): ***/
+/**@local_depth_hist[d] - number of buckets of local depth d.
+ * @occupancy_hist[n] - number of buckets holding n items.
+ * @longest_run - the largest run of directory entries sharing one bucket.
+ * **/
+struct hashmap_layout_report {
+    size_t global_depth = 0;
+    size_t unique_buckets = 0;
+    size_t items = 0;
+    uint64_t local_depth_hist[SIZE_OF_HASH + 1]{};
+    uint64_t occupancy_hist[BUCKET_SIZE + 1]{};
+    size_t directory_bytes = 0;
+    size_t bucket_bytes = 0;
+    size_t bstate_bytes = 0; // live BStates reachable from the directory
+    size_t value_bytes = 0;  // out of line values, see hashmap_indirect_value
+    size_t longest_run = 0;
+
+    void Print(std::ostream &os) const {
+        os << "global depth: " << global_depth << std::endl
+           << "buckets: " << unique_buckets << ", items: " << items << std::endl
+           << "directory bytes: " << directory_bytes << ", bucket bytes: " << bucket_bytes
+           << ", bstate bytes: " << bstate_bytes << ", value bytes: " << value_bytes << std::endl
+           << "longest run of entries per bucket: " << longest_run << std::endl;
+        os << "local depth histogram:";
+        for (int d = 0; d <= SIZE_OF_HASH; ++d)
+            if (local_depth_hist[d]) os << " " << d << ":" << local_depth_hist[d];
+        os << std::endl << "occupancy histogram:";
+        for (int n = 0; n <= BUCKET_SIZE; ++n)
+            if (occupancy_hist[n]) os << " " << n << ":" << occupancy_hist[n];
+        os << std::endl;
+    }
+};
+
+/*** Key hashing and comparison ***/
+/**@hashmap_hash - the default Hash policy, the 32 bit xxhash of the key's
+ * object bytes, which is right for trivially copyable keys. byte_key and
+ * std::string hash their contents.
+ * @hashmap_equal - the default KeyEqual policy, operator==.
+ * Policies that define is_transparent (both the byte_key and the std::string
+ * ones do) also take any probe type they can convert to a std::string_view,
+ * which lets hashmap::find look keys up without building a Key. A transparent
+ * Hash must hash a probe exactly as it hashes the equal Key.
+ * A Hash may also have Batch(keys, n, out), which batch lookups use to hash n
+ * keys at once; hashmap_hash has it, vectorized for 4 and 8 byte keys.
+ * **/
+template<typename Key>
+struct hashmap_hash {
+    xxh::hash_t<32> operator()(Key const &key) const {
+        const void *kptr = &key;
+        return xxh::xxhash<32>(kptr, sizeof(Key));
+    }
+
+    void Batch(Key const *keys, size_t const n, xxh::hash_t<32> *out) const {
+        if constexpr (std::is_trivially_copyable<Key>::value && (sizeof(Key) == 4 || sizeof(Key) == 8)) {
+            xxhash32_batch<sizeof(Key)>(keys, n, out);
+        } else {
+            for (size_t i = 0; i < n; ++i) out[i] = (*this)(keys[i]);
+        }
+    }
+};
+
+template<>
+struct hashmap_hash<byte_key> {
+    typedef void is_transparent;
+
+    xxh::hash_t<32> operator()(byte_key const &key) const {
+        return xxh::xxhash<32>(key.data(), key.size());
+    }
+
+    template<typename K>
+    xxh::hash_t<32> operator()(K const &key) const {
+        std::string_view v(key);
+        return xxh::xxhash<32>(v.data(), v.size());
+    }
+};
+
+template<>
+struct hashmap_hash<std::string> {
+    typedef void is_transparent;
+
+    xxh::hash_t<32> operator()(std::string_view key) const {
+        return xxh::xxhash<32>(key.data(), key.size());
+    }
+};
+
+template<typename Key>
+struct hashmap_equal {
+    bool operator()(Key const &a, Key const &b) const {
+        return a == b;
+    }
+};
+
+template<>
+struct hashmap_equal<byte_key> {
+    typedef void is_transparent;
+
+    bool operator()(byte_key const &a, byte_key const &b) const {
+        return a == b;
+    }
+
+    template<typename K>
+    bool operator()(byte_key const &a, K const &b) const {
+        return a.view() == std::string_view(b);
+    }
+
+    template<typename K>
+    bool operator()(K const &a, byte_key const &b) const {
+        return std::string_view(a) == b.view();
+    }
+};
+
+template<>
+struct hashmap_equal<std::string> {
+    typedef void is_transparent;
+
+    bool operator()(std::string_view a, std::string_view b) const {
+        return a == b;
+    }
+};
+
+/*** Value storage ***/
+/**@hashmap_inline_value - the Value lives in the bucket slot, every BState
+ * copy copies it.
+ * @hashmap_indirect_value - the Value lives in an immutable refcounted cell
+ * built once per insert, BState copies and helpers copy the pointer only and
+ * lookup_shared hands out the cell itself.
+ * @hashmap_value_storage - the default, indirect above INDIRECT_VALUE_SIZE bytes.
+ * **/
+template<typename Value>
+struct hashmap_inline_value {
+    typedef Value stored_type;
+
+    template<typename... Args>
+    static stored_type Make(Args &&... args) {
+        return Value(std::forward<Args>(args)...);
+    }
+
+    static Value const &Get(stored_type const &v) {
+        return v;
+    }
+
+    static shared_ptr<Value const> Share(stored_type const &v) {
+        return make_shared<Value const>(v);
+    }
+
+    static size_t OutOfLineBytes(stored_type const &) {
+        return 0;
+    }
+};
+
+template<typename Value>
+struct hashmap_indirect_value {
+    typedef shared_ptr<Value const> stored_type;
+
+    template<typename... Args>
+    static stored_type Make(Args &&... args) {
+        return make_shared<Value const>(std::forward<Args>(args)...);
+    }
+
+    static Value const &Get(stored_type const &v) {
+        return *v;
+    }
+
+    static shared_ptr<Value const> Share(stored_type const &v) {
+        return v;
+    }
+
+    static size_t OutOfLineBytes(stored_type const &) {
+        return sizeof(Value);
+    }
+};
+
+template<typename Value>
+using hashmap_value_storage = typename std::conditional<(sizeof(Value) > INDIRECT_VALUE_SIZE),
+        hashmap_indirect_value<Value>, hashmap_inline_value<Value>>::type;
+
+/*** Item expiry ***/
+/**@hashmap_no_expiry - the default, items never expire and the stamp is empty.
+ * @hashmap_expiry - every item carries the steady_clock time (ns) at which it
+ * expires, 0 for never. Expired items read as absent, ExecOnBucket reclaims
+ * them when it needs the key or the space and hashmap::sweep purges them.
+ * **/
+struct hashmap_no_expiry {
+    static constexpr bool enabled = false;
+
+    struct stamp_type {
+    };
+
+    static uint64_t Now() {
+        return 0;
+    }
+
+    static bool Expired(stamp_type, uint64_t) {
+        return false;
+    }
+
+    static stamp_type After(std::chrono::nanoseconds) {
+        return {};
+    }
+};
+
+struct hashmap_expiry {
+    static constexpr bool enabled = true;
+
+    typedef uint64_t stamp_type;
+
+    static uint64_t Now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static bool Expired(stamp_type expires, uint64_t now) {
+        return expires != 0 && expires <= now;
+    }
+
+    static stamp_type After(std::chrono::nanoseconds ttl) {
+        return Now() + ttl.count();
+    }
+};
+
+/*** Bucket state engines ***/
+/**@hashmap_bucket_states<0> - every write copies the whole BState.
+ * @hashmap_bucket_states<K> (K > 0) - the delta engine, a write publishes a
+ * BDelta over a base BState and the write after K writing deltas folds them
+ * into a new base. The default is set with -DDELTA_CHAIN_LENGTH=K, see
+ * hashmap_delta for a table of another K in the same build.
+ * **/
+template<int ChainLength>
+struct hashmap_bucket_states {
+    static_assert(ChainLength >= 0, "a delta chain has a non-negative length");
+    static constexpr int chain_length = ChainLength;
+};
+
 // Key & Value must have default constructor: Key() & Value()
-template<typename Key, typename Value>
+// Stats is hashmap_no_stats (default) or hashmap_stats
+// Hash maps a Key to a 32 bit hash, KeyEqual compares keys, both are default
+// constructed, see hashmap_hash and hashmap_equal
+// ValueStorage keeps Values in the slots or out of line, see hashmap_value_storage
+// Expiry is hashmap_no_expiry (default) or hashmap_expiry, see hashmap_ttl
+// States selects the bucket state engine, see hashmap_bucket_states
+template<typename Key, typename Value, typename Stats = hashmap_no_stats,
+        typename Hash = hashmap_hash<Key>, typename KeyEqual = hashmap_equal<Key>,
+        typename ValueStorage = hashmap_value_storage<Value>, typename Expiry = hashmap_no_expiry,
+        typename States = hashmap_bucket_states<DELTA_CHAIN_LENGTH>>
 class hashmap {
+    friend struct hashmap_bench_access; // kernel microbenchmarks, see benchmarks/WFEXT
     // private:
     enum Status_type {
         FALSE, TRUE, FAIL
     };
 
+    // One item, a BState keeps the fields of its items in separate arrays
     struct Triple {
         bool valid_item;
+        typename Expiry::stamp_type expires;
         xxh::hash_t<32> hash;
         Key key;
-        Value value;
+        typename ValueStorage::stored_type value;
 
-        Triple() : valid_item(false) {}
+        Triple() : valid_item(false), expires() {}
 
-        Triple(xxh::hash_t<32> h, Key k, Value v) :
-                valid_item(true), hash(h), key(k), value(v) {};
+        Triple(xxh::hash_t<32> h, Key k, typename ValueStorage::stored_type v) :
+                valid_item(true), expires(), hash(h), key(k), value(v) {};
     };
 
+    // The conditional ops take effect only if their condition holds on the
+    // bucket state they are applied to (status TRUE, else FALSE), and record
+    // the value they saw in their Result, as do MERGE, EXCHANGE and TAKE.
+    // MERGE stores value if the key is absent, else combine(old value, value).
+    // EXCHANGE and TAKE are INS and DEL that report the value they replaced.
+    // DEL and TAKE of an absent key report FALSE.
     enum Op_type {
-        NONE, INS, DEL
+        NONE, INS, DEL, INS_IF_ABSENT, REPLACE_IF_PRESENT, COMPARE_AND_SWAP, REMOVE_IF_EQUAL, MERGE,
+        EXCHANGE, TAKE
     };
 
+    // Built once per op in help[id] and never changed, the value is in its
+    // stored form already so helpers copy it into slots as is
+    // @expected, @value_equal - the value COMPARE_AND_SWAP and REMOVE_IF_EQUAL
+    // compare with, and how (set by the public function, so only the users of
+    // those ops need a Value::operator==)
+    // @combine - the MERGE combiner, every helper that applies the op calls
+    // it, so it must be deterministic and free of side effects
+    // @expires - the expiry of an item stored by INS, EXCHANGE or a new key,
+    // the other updates keep the item's expiry
     struct Operation {
         Op_type type;
         Key key;
-        Value value;
+        typename ValueStorage::stored_type value;
         int seqnum;
         xxh::hash_t<32> hash;
+        typename ValueStorage::stored_type expected;
+        bool (*value_equal)(Value const &, Value const &);
+        std::function<Value(Value const &, Value const &)> combine;
+        typename Expiry::stamp_type expires;
 
-        Operation() : type(NONE) {}
-
-        Operation(Op_type t, Key k, Value v, int seq, xxh::hash_t<32> h) :
-                type(t), key(k), value(v), seqnum(seq), hash(h) {};
+        Operation() : type(NONE), seqnum(0), hash(), expected(), value_equal(nullptr), expires() {}
 
-        Operation(Op_type t, Key k, int seq, xxh::hash_t<32> h) :
-                type(t), key(k), value(), seqnum(seq), hash(h) {};
+        // seqnum and hash are set by RunOp
+        Operation(Op_type t, Key k, typename ValueStorage::stored_type v = {}) :
+                type(t), key(std::move(k)), value(std::move(v)), seqnum(0), hash(), expected(),
+                value_equal(nullptr), expires() {};
     };
 
     struct Result {
@@ -66,6 +449,38 @@ class hashmap {
         int seqnum;
     };
 
+    static_assert(sizeof(Result) == 2 * sizeof(int), "every bucket state holds a Result per thread, keep it small");
+
+    /* The value an op saw (see Op_type), reported out of band: the state the
+     * op is applied in lists it in its reports, and the states after it keep
+     * the entry until the owner has taken the value, so a state carries
+     * values only for the ops whose owners have not returned yet. */
+    struct Report {
+        typename ValueStorage::stored_type prior;
+        mutable std::atomic<bool> taken; // set by the owner once it has the value
+
+        explicit Report(typename ValueStorage::stored_type const &v) : prior(v), taken(false) {}
+    };
+
+    struct Reported {
+        unsigned int thread;
+        int seqnum;
+        shared_ptr<Report const> report;
+    };
+
+    typedef std::vector<Reported> Reports;
+
+    // A submitted op, its record is moved to help[id] when it is the oldest one
+    struct Submitted {
+        Operation op;
+        xxh::hash_t<32> hash;
+        std::promise<bool> done;
+        void (*resume)(void *); // set by a suspended coroutine, run on completion
+        void *resume_arg;
+
+        explicit Submitted(Operation op) : op(std::move(op)), hash(), resume(nullptr), resume_arg(nullptr) {}
+    };
+
     struct BigWord {
         bool Data[BIGWORD_SIZE];
 
@@ -96,74 +511,484 @@ class hashmap {
         }
     };
 
-    struct BState {
-        Triple items[BUCKET_SIZE]; // if (item_valid == false) place is free
-        Result results[NUMBER_OF_THREADS];
-        BigWord applied;
+    // The CLOCK reference bit of every slot. Lookups set them in the
+    // published BState itself (the only field that is written after
+    // publication), a copy takes the bits it sees.
+    struct RefBits {
+        mutable std::atomic<uint64_t> bits;
 
-    public:
-        BState() : items(), results(), applied() {}
+        RefBits() : bits(0) {}
 
-        BState(BState const &old) : applied(old.applied) {
-            for (int i = 0; i < BUCKET_SIZE; i++)
-                this->items[i] = old.items[i];
+        RefBits(RefBits const &r) : bits(r.bits.load(std::memory_order_relaxed)) {}
 
-            for (int i = 0; i < NUMBER_OF_THREADS; i++)
-                this->results[i] = old.results[i];
-        };
+        RefBits &operator=(RefBits const &r) = delete;
 
-        BState(const Result *const res, BigWord const &applied)
-                : items(), applied(applied) {
-            for (int i = 0; i < NUMBER_OF_THREADS; i++)
-                this->results[i] = res[i];
+        void Mark(int const i) const {
+            uint64_t const mask = (uint64_t) 1 << i;
+            if (!(bits.load(std::memory_order_relaxed) & mask)) // a shared line is only written once
+                bits.fetch_or(mask, std::memory_order_relaxed);
         }
 
-        BState operator=(BState b) = delete;
+        bool TestAndClear(int const i) { // unpublished BStates only
+            bool const set = bits.load(std::memory_order_relaxed) & ((uint64_t) 1 << i);
+            Clear(i);
+            return set;
+        }
+
+        void Clear(int const i) { // unpublished BStates only
+            bits.store(bits.load(std::memory_order_relaxed) & ~((uint64_t) 1 << i), std::memory_order_relaxed);
+        }
+    };
+
+    static_assert(BUCKET_SIZE <= 64, "a 64 bit word holds the occupancy and the reference bit of every slot");
+
+    /* The slot bookkeeping of a bucket state, shared by BState and BDelta over
+     * their item accessors (HashAt, KeyAt, ExpiresAt), and the reports of the
+     * ops applied in it */
+    template<typename State>
+    struct SlotSet {
+        uint64_t occupied; // bit i is set when slot i holds an item
+        int hand; // the CLOCK hand of EvictOne
+        RefBits refs;
+        shared_ptr<Reports const> reports; // shared by the states after it until an op reports
+
+        static constexpr uint64_t ALL_SLOTS = BUCKET_SIZE == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << BUCKET_SIZE) - 1;
+
+        SlotSet() : occupied(0), hand(0), refs() {}
+
+        template<typename Other>
+        explicit SlotSet(SlotSet<Other> const &s) : occupied(s.occupied), hand(s.hand), refs(s.refs),
+                                                    reports(s.reports) {}
+
+        State const &Self() const {
+            return static_cast<State const &>(*this);
+        }
 
-        bool InsertItem(Triple const t) {
-            for (Triple &item : items) {
-                if (!item.valid_item) {
-                    item = t;
-                    return true;
+        bool IsValid(int const i) const {
+            return (occupied >> i) & 1;
+        }
+
+        int Count() const {
+            return __builtin_popcountll(occupied);
+        }
+
+        bool IsFull() const {
+            return occupied == ALL_SLOTS;
+        }
+
+        void Free(int const i) {
+            occupied &= ~((uint64_t) 1 << i);
+        }
+
+        /* Frees the slots of expired items, returns how many */
+        int PurgeExpired(uint64_t const now) {
+            int purged = 0;
+            for (uint64_t m = occupied; m; m &= m - 1) {
+                int const i = __builtin_ctzll(m);
+                if (Expiry::Expired(Self().ExpiresAt(i), now)) {
+                    Free(i);
+                    ++purged;
                 }
             }
-            return false; // bucket is full
+            return purged;
+        }
+
+        /* CLOCK: frees the first slot from the hand on whose reference bit is
+         * clear, clearing the bits it passes, never the slot of (keep, keep_hash).
+         * Returns the freed slot, NOT_FOUND if there was no other item. */
+        int EvictOne(Key const &keep, xxh::hash_t<32> const keep_hash) {
+            for (int n = 0; n < 2 * BUCKET_SIZE; ++n) { // the second round finds the bits cleared
+                int const i = hand;
+                hand = (hand + 1) % BUCKET_SIZE;
+                if (!IsValid(i) || (Self().HashAt(i) == keep_hash && KeyEqual()(Self().KeyAt(i), keep)))
+                    continue;
+                if (refs.TestAndClear(i))
+                    continue;
+                Free(i);
+                return i;
+            }
+            return NOT_FOUND;
+        }
+
+        bool HasExpired(uint64_t const now) const {
+            for (uint64_t m = occupied; m; m &= m - 1)
+                if (Expiry::Expired(Self().ExpiresAt(__builtin_ctzll(m)), now)) return true;
+            return false;
         }
 
         /*Returns the free entry if exists, else -1 for full bucket */
         int BucketAvailability() const {
-            for (int i = 0; i < BUCKET_SIZE; i++) {
-                if (!this->items[i].valid_item)
-                    return i;
-            }
-            return FULL_BUCKET;
+            if (IsFull()) return FULL_BUCKET;
+            return __builtin_ctzll(~occupied);
+        }
+
+        int GetItem(Key const &key, xxh::hash_t<32> const hash) const {
+            return Self().Find(key, hash, KeyEqual());
         }
 
         int GetItem(Triple const &c) const {
-            for (int i = 0; i < BUCKET_SIZE; i++) {
-                if (items[i].valid_item && c.key == items[i].key)
-                    return i;
+            return GetItem(c.key, c.hash);
+        }
+
+        // The report of op seqnum of thread j, nullptr if it reported no value
+        Report const *ReportOf(unsigned int const j, int const seqnum) const {
+            if (reports)
+                for (Reported const &r : *reports)
+                    if (r.thread == j && r.seqnum == seqnum) return r.report.get();
+            return nullptr;
+        }
+
+        /* Reports prior for op seqnum of thread j (unpublished states only).
+         * The new list drops the entries whose value was taken and those of
+         * threads with a later op applied here. */
+        void AddReport(unsigned int const j, int const seqnum, typename ValueStorage::stored_type const &prior) {
+            shared_ptr<Reports> next = make_shared<Reports>();
+            if (reports)
+                for (Reported const &r : *reports)
+                    if (r.thread != j && !r.report->taken.load(std::memory_order_relaxed)
+                        && Self().ResultOf(r.thread).seqnum == r.seqnum)
+                        next->push_back(r);
+            next->push_back(Reported{j, seqnum, make_shared<Report const>(prior)});
+            reports = next;
+        }
+    };
+
+    /* The items are kept as arrays of their fields (structure of arrays), so a
+     * key search reads the hashes and then only the keys they point at, and
+     * occupancy is one word. Triple is the single item view of a slot. */
+    struct BState : SlotSet<BState> {
+        using SlotSet<BState>::occupied;
+        using SlotSet<BState>::IsValid;
+        using SlotSet<BState>::BucketAvailability;
+
+        xxh::hash_t<32> hashes[BUCKET_SIZE];
+        Key keys[BUCKET_SIZE];
+        typename ValueStorage::stored_type values[BUCKET_SIZE];
+        typename Expiry::stamp_type expires[BUCKET_SIZE];
+        Result results[NUMBER_OF_THREADS];
+        BigWord applied;
+
+    public:
+        BState() : hashes(), keys(), values(), expires(), results(), applied() {}
+
+        BState(BState const &old) = default; // copy constructs the items, no default + assign
+
+        // An empty state with the results and reports of from
+        template<typename From>
+        BState(From const &from, BigWord const &applied)
+                : hashes(), keys(), values(), expires(), applied(applied) {
+            for (unsigned int i = 0; i < NUMBER_OF_THREADS; i++)
+                this->results[i] = from.ResultOf(i);
+            this->reports = from.reports;
+        }
+
+        BState operator=(BState b) = delete;
+
+        xxh::hash_t<32> HashAt(int const i) const {
+            return hashes[i];
+        }
+
+        Key const &KeyAt(int const i) const {
+            return keys[i];
+        }
+
+        typename ValueStorage::stored_type const &ValueAt(int const i) const {
+            return values[i];
+        }
+
+        typename Expiry::stamp_type const &ExpiresAt(int const i) const {
+            return expires[i];
+        }
+
+        Result const &ResultOf(unsigned int const j) const {
+            return results[j];
+        }
+
+        Result &ResultFor(unsigned int const j) { // unpublished BStates only
+            return results[j];
+        }
+
+        bool AppliedBit(unsigned int const j) const {
+            return applied.TestBit(j);
+        }
+
+        void SetApplied(BigWord const &toggle) {
+            applied = toggle;
+        }
+
+        void Occupy(int const i, xxh::hash_t<32> const hash, Key const &key,
+                    typename ValueStorage::stored_type const &value, typename Expiry::stamp_type const &stamp) {
+            hashes[i] = hash;
+            keys[i] = key;
+            values[i] = value;
+            expires[i] = stamp;
+            occupied |= (uint64_t) 1 << i;
+        }
+
+        void SetValue(int const i, typename ValueStorage::stored_type const &value) {
+            values[i] = value;
+        }
+
+        void SetExpires(int const i, typename Expiry::stamp_type const &stamp) {
+            expires[i] = stamp;
+        }
+
+        Triple ItemAt(int const i) const {
+            Triple t(hashes[i], keys[i], values[i]);
+            t.valid_item = IsValid(i);
+            t.expires = expires[i];
+            return t;
+        }
+
+        bool InsertItem(Triple const &t) {
+            int const i = BucketAvailability();
+            if (i == FULL_BUCKET) return false;
+            Occupy(i, t.hash, t.key, t.value, t.expires);
+            return true;
+        }
+
+        // Copies slot i of from into a free slot
+        template<typename From>
+        bool InsertItem(From const &from, int const i) {
+            int const free = BucketAvailability();
+            if (free == FULL_BUCKET) return false;
+            Occupy(free, from.HashAt(i), from.KeyAt(i), from.ValueAt(i), from.ExpiresAt(i));
+            return true;
+        }
+
+        /* The slot of key, NOT_FOUND if absent. Walks the occupied slots only,
+         * reading their hashes and the keys of the hashes that match. */
+        template<typename K, typename Equal>
+        int Find(K const &key, xxh::hash_t<32> const hash, Equal const &eq) const {
+            return FindIn(key, hash, eq, occupied);
+        }
+
+        // Find among the slots set in mask
+        template<typename K, typename Equal>
+        int FindIn(K const &key, xxh::hash_t<32> const hash, Equal const &eq, uint64_t const mask) const {
+            for (uint64_t m = mask; m; m &= m - 1) {
+                int const i = __builtin_ctzll(m);
+                if (hashes[i] == hash && eq(keys[i], key)) return i;
             }
             return NOT_FOUND;
         }
 
+        size_t Bytes() const {
+            return sizeof(BState);
+        }
+
         ~BState() = default;
     };
 
+    /* A bucket state of the delta engine (States::chain_length > 0): a base
+     * BState and the slots and results that the writes since the base changed.
+     * A write publishes a new delta with its changes added to those of the one
+     * it replaces, so a reader looks at one delta and the base whatever the
+     * number of writes. Occupancy, the applied bits, the hand and the reference
+     * bits are whole in every delta. Like a BState, a delta is only changed
+     * before it is published. */
+    struct BDelta : SlotSet<BDelta> {
+        using SlotSet<BDelta>::occupied;
+        using SlotSet<BDelta>::hand;
+        using SlotSet<BDelta>::refs;
+        using SlotSet<BDelta>::IsValid;
+
+        struct Slot {
+            int slot;
+            xxh::hash_t<32> hash;
+            Key key;
+            typename ValueStorage::stored_type value;
+            typename Expiry::stamp_type expires;
+        };
+
+        shared_ptr<BState const> base;
+        int chain; // the deltas since base that wrote something, this one included once it does
+        bool wrote;
+        uint64_t written; // the slots in slots
+        uint64_t reported[(NUMBER_OF_THREADS + 63) / 64]; // the threads in results
+        BigWord applied;
+        std::vector<Slot> slots; // one entry per slot written since base
+        std::vector<std::pair<unsigned int, Result>> results; // one entry per thread
+
+    public:
+        // The first delta over b
+        explicit BDelta(shared_ptr<BState const> const &b)
+                : SlotSet<BDelta>(*b), base(b), chain(0), wrote(false), written(0), reported(), applied(b->applied) {}
+
+        // The delta after old, with the same changes
+        explicit BDelta(BDelta const &old)
+                : SlotSet<BDelta>(old), base(old.base), chain(old.chain), wrote(false), written(old.written),
+                  applied(old.applied), slots(old.slots), results(old.results) {
+            std::copy(std::begin(old.reported), std::end(old.reported), reported);
+        }
+
+        BDelta operator=(BDelta d) = delete;
+
+        // The entry of slot i, nullptr if the item is in base
+        Slot const *Written(int const i) const {
+            if (!((written >> i) & 1)) return nullptr;
+            for (Slot const &s : slots)
+                if (s.slot == i) return &s;
+            return nullptr;
+        }
+
+        xxh::hash_t<32> HashAt(int const i) const {
+            Slot const *const s = Written(i);
+            return s ? s->hash : base->hashes[i];
+        }
+
+        Key const &KeyAt(int const i) const {
+            Slot const *const s = Written(i);
+            return s ? s->key : base->keys[i];
+        }
+
+        typename ValueStorage::stored_type const &ValueAt(int const i) const {
+            Slot const *const s = Written(i);
+            return s ? s->value : base->values[i];
+        }
+
+        typename Expiry::stamp_type const &ExpiresAt(int const i) const {
+            Slot const *const s = Written(i);
+            return s ? s->expires : base->expires[i];
+        }
+
+        Result const &ResultOf(unsigned int const j) const {
+            if ((reported[j / 64] >> j % 64) & 1)
+                for (auto const &r : results)
+                    if (r.first == j) return r.second;
+            return base->results[j];
+        }
+
+        // The result of j in this delta, the reference lasts until the next call
+        Result &ResultFor(unsigned int const j) {
+            Wrote();
+            for (auto &r : results)
+                if (r.first == j) return r.second;
+            results.emplace_back(j, base->results[j]);
+            reported[j / 64] |= (uint64_t) 1 << j % 64;
+            return results.back().second;
+        }
+
+        bool AppliedBit(unsigned int const j) const {
+            return applied.TestBit(j);
+        }
+
+        void SetApplied(BigWord const &toggle) {
+            applied = toggle;
+        }
+
+        void Occupy(int const i, xxh::hash_t<32> const hash, Key const &key,
+                    typename ValueStorage::stored_type const &value, typename Expiry::stamp_type const &stamp) {
+            Wrote();
+            occupied |= (uint64_t) 1 << i;
+            for (Slot &s : slots)
+                if (s.slot == i) {
+                    s = Slot{i, hash, key, value, stamp};
+                    return;
+                }
+            slots.push_back(Slot{i, hash, key, value, stamp});
+            written |= (uint64_t) 1 << i;
+        }
+
+        void SetValue(int const i, typename ValueStorage::stored_type const &value) {
+            Own(i).value = value;
+        }
+
+        void SetExpires(int const i, typename Expiry::stamp_type const &stamp) {
+            Own(i).expires = stamp;
+        }
+
+        /* Like BState::Find, the written slots and then those of base */
+        template<typename K, typename Equal>
+        int Find(K const &key, xxh::hash_t<32> const hash, Equal const &eq) const {
+            for (Slot const &s : slots)
+                if (IsValid(s.slot) && s.hash == hash && eq(s.key, key)) return s.slot;
+            return base->FindIn(key, hash, eq, occupied & ~written);
+        }
+
+        // The changes folded into a copy of base, for the next first delta
+        shared_ptr<BState> Compact() const {
+            shared_ptr<BState> b = NewNode<BState>(*base);
+            b->occupied = occupied;
+            b->hand = hand;
+            b->refs.bits.store(refs.bits.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            b->applied = applied;
+            b->reports = this->reports;
+            for (Slot const &s : slots)
+                if (IsValid(s.slot)) b->Occupy(s.slot, s.hash, s.key, s.value, s.expires);
+            for (auto const &r : results)
+                b->results[r.first] = r.second;
+            return b;
+        }
+
+        size_t Bytes() const {
+            return sizeof(BDelta) + slots.capacity() * sizeof(Slot)
+                   + results.capacity() * sizeof(std::pair<unsigned int, Result>) + base->Bytes();
+        }
+
+    private:
+        void Wrote() {
+            if (!wrote) ++chain;
+            wrote = true;
+        }
+
+        Slot &Own(int const i) { // the entry of slot i, made from the item if it has none
+            Wrote();
+            for (Slot &s : slots)
+                if (s.slot == i) return s;
+            slots.push_back(Slot{i, HashAt(i), KeyAt(i), ValueAt(i), ExpiresAt(i)});
+            written |= (uint64_t) 1 << i;
+            return slots.back();
+        }
+    };
+
+    // The bucket state type that Buckets publish
+    typedef typename std::conditional<(States::chain_length > 0), BDelta, BState>::type BNode;
+
+    /* Nodes and directory arrays come from the huge page arena (see arena.h)
+     * when built with HASHMAP_HUGE_PAGES, so the states a lookup walks sit on
+     * few 2 MB pages instead of many 4 KB ones */
+    template<typename T, typename... Args>
+    static shared_ptr<T> NewNode(Args &&... args) {
+#ifdef HASHMAP_HUGE_PAGES
+        return std::allocate_shared<T>(hashmap_arena_allocator<T>(), std::forward<Args>(args)...);
+#else
+        return shared_ptr<T>(new T(std::forward<Args>(args)...));
+#endif
+    }
+
+    struct Bucket_ptr;
+
+    static shared_ptr<Bucket_ptr[]> NewDir(size_t const entries) {
+#ifdef HASHMAP_HUGE_PAGES
+        size_t const bytes = entries * sizeof(Bucket_ptr);
+        if (bytes >= ARENA_CHUNK_SIZE / 2) { // huge pages of its own
+            size_t const mapped = (bytes + ARENA_CHUNK_SIZE - 1) / ARENA_CHUNK_SIZE * ARENA_CHUNK_SIZE;
+            Bucket_ptr *dir = static_cast<Bucket_ptr *>(MapHugePages(mapped));
+            for (size_t i = 0; i < entries; ++i) new(dir + i) Bucket_ptr();
+            return shared_ptr<Bucket_ptr[]>(dir, [entries, mapped](Bucket_ptr *d) {
+                for (size_t i = 0; i < entries; ++i) d[i].~Bucket_ptr();
+                UnmapHugePages(d, mapped);
+            });
+        }
+#endif
+        return shared_ptr<Bucket_ptr[]>(new Bucket_ptr[entries]);
+    }
+
     struct Bucket {
         uint32_t prefix;
         size_t depth;
-        shared_ptr<BState> state;
+        shared_ptr<BNode> state;
         BigWord toggle;
 
     public:
         Bucket() : prefix(), depth(), toggle() {
-            atomic_store(&state, make_shared<BState>());
+            atomic_store(&state, AsNode(NewNode<BState>()));
         }
 
         Bucket(const Bucket &b) = delete;
 
-        explicit Bucket(uint32_t p, size_t d, shared_ptr<BState> s, BigWord t)
+        explicit Bucket(uint32_t p, size_t d, shared_ptr<BNode> s, BigWord t)
             : prefix(p), depth(d), toggle(t) {
             atomic_store(&state, s);
         }
@@ -184,10 +1009,10 @@ class hashmap {
     public:
         DState() : depth(1) {
             assert(0 < depth && depth < 20);
-            shared_ptr<Bucket_ptr[]> dir_temp(new Bucket_ptr[POW(depth)]);
+            shared_ptr<Bucket_ptr[]> dir_temp = NewDir(POW(depth));
             dir = dir_temp;
             for (int i = 0; i < POW(depth); i++) {
-                shared_ptr<Bucket> temp(new Bucket());
+                shared_ptr<Bucket> temp = NewNode<Bucket>();
                 dir[i].b_ptr = temp;
                 dir[i].b_ptr->depth = 1;
                 dir[i].b_ptr->prefix = i;
@@ -199,7 +1024,7 @@ class hashmap {
         }
 
         DState(const DState &d) : depth(d.depth) {
-            shared_ptr<Bucket_ptr[]> dir_temp(new Bucket_ptr[POW(depth)]);
+            shared_ptr<Bucket_ptr[]> dir_temp = NewDir(POW(depth));
             dir = dir_temp;
             for (int i = 0; i < POW(depth); i++) {
                 dir[i].b_ptr = d.dir[i].b_ptr;
@@ -209,7 +1034,7 @@ class hashmap {
         DState operator=(DState b) = delete;
 
         void EnlargeDir() {
-            shared_ptr<Bucket_ptr[]> next_dir(new Bucket_ptr[POW(depth + 1)]);
+            shared_ptr<Bucket_ptr[]> next_dir = NewDir(POW(depth + 1));
             for (int i = 0; i < POW(depth); ++i) {
                 next_dir[(i << 1) + 0].b_ptr = dir[i].b_ptr;
                 next_dir[(i << 1) + 1].b_ptr = dir[i].b_ptr;
@@ -224,100 +1049,263 @@ class hashmap {
 
     /*** Global variables of the class goes below: ***/
     /**@ht - a pointer to the most recent DState.
-     * @help - an array of size N and each thread will only access its own space.
+     * @help - an array of size N, each thread only publishes its own entry. An
+     * entry is an immutable Operation, helpers load it atomically, so an owner
+     * starting its next op never frees a key that a helper is still reading.
      * @opSeqnum - an array of size N each thread holds a counter that represent the
      * amount of operations it has done.
+     * @sizeDelta - per thread, the items the states it published added minus
+     * removed, only written by that thread so size_approx() does not contend.
+     * @sweepCursor - the directory entry the next sweep() starts at.
+     * @capacity - the item budget of capacity mode, 0 for unbounded.
+     * @submitted - per thread, its submitted ops that are not completed yet,
+     * only touched by that thread.
+     * @counters - the statistics policy, see hashmap_stats.
+     * @hasher, @equal - the Hash and KeyEqual policies.
      * **/
     shared_ptr<DState> ht;
-    Operation help[NUMBER_OF_THREADS];
+    shared_ptr<Operation const> help[NUMBER_OF_THREADS];
     unsigned long long opSeqnum[NUMBER_OF_THREADS]{};
+    struct alignas(64) SizeDelta {
+        std::atomic<int64_t> n{0};
+    } sizeDelta[NUMBER_OF_THREADS];
+    std::atomic<size_t> sweepCursor{0};
+    std::atomic<size_t> capacity{0};
+    struct alignas(64) SubmitQueue {
+        std::deque<Submitted> ops; // the front one is in help[id]
+        bool flipped = false; // AnnounceFront flipped the toggle bit, the next round must not
+    } submitted[NUMBER_OF_THREADS];
+    mutable Stats counters;
+    Hash hasher;
+    KeyEqual equal;
 
     /*** Inner function section goes below: ***/
 
+    template<typename... Args>
+    shared_ptr<BState> NewBState(unsigned int id, Args const &... args) {
+        counters.Add(id, STAT_BSTATE_BYTES, sizeof(BState));
+        return NewNode<BState>(args...);
+    }
+
+    // The first published state over base, base itself for the copy engine
+    static shared_ptr<BNode> AsNode(shared_ptr<BState> const &base) {
+        if constexpr (States::chain_length > 0)
+            return NewNode<BDelta>(shared_ptr<BState const>(base));
+        else
+            return base;
+    }
 
-    void ApplyWFOp(Bucket_ptr b, unsigned int id) {
+    /* The private next state of a bucket, for the pending ops to be applied
+     * to: a copy of old, or with the delta engine the next delta, which folds
+     * the changes into a new base every States::chain_length writing deltas */
+    shared_ptr<BNode> NextState(unsigned int const id, shared_ptr<BNode> const &old) {
+        if constexpr (States::chain_length > 0) {
+            if (old->chain >= States::chain_length) {
+                counters.Add(id, STAT_BSTATE_BYTES, sizeof(BState) + sizeof(BDelta));
+                return AsNode(old->Compact());
+            }
+            counters.Add(id, STAT_BSTATE_BYTES, sizeof(BDelta) + old->slots.size() * sizeof(typename BDelta::Slot)
+                                                + old->results.size() * sizeof(std::pair<unsigned int, Result>));
+            return NewNode<BDelta>(*old);
+        } else {
+            return NewBState(id, *old);
+        }
+    }
+
+
+    // announce is false when a submitted op already flipped the bit of id
+    void ApplyWFOp(Bucket_ptr b, unsigned int id, bool const announce = true) {
         BigWord oldToggle;
-        b.b_ptr->toggle.FlipBit(id); // mark as worked on by thread id
+        if (announce)
+            b.b_ptr->toggle.FlipBit(id); // mark as worked on by thread id
 
         for (int i = 0; i < 2; i++) {
-            shared_ptr<BState> oldBState = atomic_load(&b.b_ptr->state);
-            shared_ptr<BState> nextBState(new BState(*oldBState)); // copy constructor, pointer assignment
+            shared_ptr<BNode> oldBState = atomic_load(&b.b_ptr->state);
+            shared_ptr<BNode> nextBState = NextState(id, oldBState);
             oldToggle = b.b_ptr->toggle; // copy constructor using operator=
+            ApplyPending(nextBState, *b.b_ptr, oldToggle, id);
+            int const items = nextBState->Count() - oldBState->Count();
 
-            for (unsigned int j = 0; j <= NUMBER_OF_THREADS; j++) {
-                if (oldToggle.TestBit(j) == nextBState->applied.TestBit(j))
-                    continue;
-                //assert(nextBState->results[j].seqnum >= 0 && help[j].seqnum > 0);
-                if (nextBState->results[j].seqnum < help[j].seqnum) {
-                    nextBState->results[j].status = ExecOnBucket(nextBState, help[j]);
-                    if (nextBState->results[j].status != FAIL)
-                        nextBState->results[j].seqnum = help[j].seqnum;
+            if (atomic_compare_exchange_weak(&b.b_ptr->state, &oldBState, nextBState)) {
+                counters.Add(id, STAT_CAS_SUCCESS);
+                AddSize(id, items);
+            } else {
+                counters.Add(id, STAT_CAS_FAILURE);
+            }
+        }
+    }
+
+    /* Applies to nextBState, the next state of b, every op announced in toggle
+     * and not applied yet. An announce is a publish then a flip, so a resize
+     * can apply the op to a new bucket before the flip lands there; the bit
+     * then stays set after the op is done, and the next op of that thread,
+     * for another bucket, is only absorbed here, never applied. */
+    void ApplyPending(shared_ptr<BNode> const &nextBState, Bucket const &b, BigWord const &toggle,
+                      unsigned int const id) {
+        for (unsigned int j = 0; j < NUMBER_OF_THREADS; j++) {
+            if (toggle.TestBit(j) == nextBState->AppliedBit(j))
+                continue;
+            shared_ptr<Operation const> const op = atomic_load(&help[j]);
+            //assert(nextBState->ResultOf(j).seqnum >= 0 && op->seqnum > 0);
+            if (nextBState->ResultOf(j).seqnum < op->seqnum && Prefix(op->hash, b.depth) == b.prefix) {
+                Status_type const status = ExecOnBucket(nextBState, *op, j);
+                Result &res = nextBState->ResultFor(j);
+                res.status = status;
+                if (status != FAIL) {
+                    res.seqnum = op->seqnum;
+                    if (j != id) counters.Add(id, STAT_HELPED);
                 }
             }
-            nextBState->applied = oldToggle; // copy constructor using operator=
+        }
+        nextBState->SetApplied(toggle);
+    }
 
-            atomic_compare_exchange_weak(&b.b_ptr->state,
-                    &oldBState, nextBState);
+    /* One copy-and-CAS of b that purges its expired items, and applies the
+     * pending ops like any ApplyWFOp attempt so helping is not delayed.
+     * Returns the number of purged items, 0 if the CAS lost. */
+    int SweepBucket(Bucket_ptr const b, unsigned int const id) {
+        uint64_t const now = Expiry::Now();
+        shared_ptr<BNode> oldBState = atomic_load(&b.b_ptr->state);
+        if (!oldBState->HasExpired(now)) return 0;
+        if (oldBState->IsFull()) return SweepFullBucket(b, id);
+        shared_ptr<BNode> nextBState = NextState(id, oldBState);
+        BigWord const toggle = b.b_ptr->toggle;
+        ApplyPending(nextBState, *b.b_ptr, toggle, id);
+        int const purged = nextBState->PurgeExpired(now);
+        int const items = nextBState->Count() - oldBState->Count();
+        if (!atomic_compare_exchange_weak(&b.b_ptr->state, &oldBState, nextBState)) {
+            counters.Add(id, STAT_CAS_FAILURE);
+            return 0;
         }
+        counters.Add(id, STAT_CAS_SUCCESS);
+        AddSize(id, items);
+        return purged;
     }
 
-    Status_type ExecOnBucket(shared_ptr<BState> b, Operation const &op) {
+    /* A full state is never changed, so a full b is swapped for a compacted
+     * copy through ht instead, with the pending ops on b applied to the copy
+     * as a resize does. Returns the number of purged items, 0 if the CAS of
+     * ht lost or b has left the directory. */
+    int SweepFullBucket(Bucket_ptr const b, unsigned int const id) {
+        shared_ptr<DState> oldD = atomic_load(&ht);
+        if (b.b_ptr->depth > oldD->depth
+            || oldD->dir[(size_t) b.b_ptr->prefix << (oldD->depth - b.b_ptr->depth)].b_ptr != b.b_ptr)
+            return 0;
+        shared_ptr<DState> nextD(new DState(*oldD));
+        int const purged = CompactBucket(*nextD, b, Operation(), id);
+        if (!purged) return 0;
+        int const items = ApplyPendingResize(*nextD, *b.b_ptr, id) - purged;
+        if (!atomic_compare_exchange_weak(&ht, &oldD, nextD)) return 0;
+        AddSize(id, items);
+        return purged;
+    }
 
-        int freeID = b->BucketAvailability();
-        if (freeID == FULL_BUCKET) {
+    /* Applies op of thread j to b, the status goes to the result of j by the
+     * caller, the value the op saw to the reports of b. A full b is never
+     * changed (FAIL), resizes rely on full states being frozen; freed is the
+     * number of items the resize dropped from b for this op, they make room. */
+    Status_type ExecOnBucket(shared_ptr<BNode> const &b, Operation const &op, unsigned int const j,
+                             int const freed = 0) {
+
+        uint64_t const now = Expiry::Now();
+        int purged = freed;
+        bool const evict = AtCapacity();
+        if (b->IsFull()) {
             return FAIL;
         } else {
-            Triple c(op.hash, op.key, op.value);
-            int updateID = b->GetItem(c);
-            // case remove
-            if (op.type == DEL) {
-                if (updateID != NOT_FOUND) {
-                    b->items[updateID].valid_item = false;
-                }
-                return TRUE;
+            int updateID = b->GetItem(op.key, op.hash);
+            if (Expiry::enabled && updateID != NOT_FOUND && Expiry::Expired(b->ExpiresAt(updateID), now)) {
+                b->Free(updateID); // an expired key is absent
+                ++purged;
+                updateID = NOT_FOUND;
             }
-            // case insert or update
-            if (updateID == NOT_FOUND) {
-                if (op.type == INS) {
-                    b->items[freeID] = c;
-                }
+            bool const found = updateID != NOT_FOUND;
+            if (found && op.type != INS && op.type != DEL)
+                b->AddReport(j, op.seqnum, b->ValueAt(updateID));
+
+            switch (op.type) {
+                case DEL:
+                case TAKE:
+                case REMOVE_IF_EQUAL:
+                    if (!found)
+                        return FALSE;
+                    if (op.type == REMOVE_IF_EQUAL && !ValueMatches(b->ValueAt(updateID), op))
+                        return FALSE;
+                    b->Free(updateID);
+                    return TRUE;
+                case INS_IF_ABSENT:
+                    if (found) return FALSE; // the key is taken, keep its value
+                    break;
+                case REPLACE_IF_PRESENT:
+                    if (!found) return FALSE;
+                    break;
+                case COMPARE_AND_SWAP:
+                    if (!found || !ValueMatches(b->ValueAt(updateID), op)) return FALSE;
+                    break;
+                case MERGE:
+                    if (found) {
+                        b->SetValue(updateID, ValueStorage::Make(
+                                op.combine(ValueStorage::Get(b->ValueAt(updateID)), ValueStorage::Get(op.value))));
+                        return TRUE;
+                    }
+                    break;
+                default:
+                    break;
+            }
+            // case insert or update, the op record is copied into the slot once
+            if (!found) {
+                if (evict && purged == 0)
+                    b->EvictOne(op.key, op.hash); // at capacity a new key takes the place of an old one
+                int const slot = b->BucketAvailability();
+                b->Occupy(slot, op.hash, op.key, op.value, op.expires);
+                b->refs.Clear(slot); // the slot may have been referenced by a removed item
             } else {
-                if (op.type == INS) {
-                    b->items[updateID] = c;
-                }
+                b->SetValue(updateID, op.value);
+                if (op.type == INS || op.type == EXCHANGE)
+                    b->SetExpires(updateID, op.expires);
             }
         }
         return TRUE;
     }
 
-    shared_ptr<Bucket_ptr[]> SplitBucket(Bucket_ptr const b) { // returns 2 new Buckets
-        const shared_ptr<BState> bs = atomic_load(&b.b_ptr->state);
+    static bool ValueMatches(typename ValueStorage::stored_type const &v, Operation const &op) {
+        return op.value_equal(ValueStorage::Get(v), ValueStorage::Get(op.expected));
+    }
+
+    shared_ptr<Bucket_ptr[]> SplitBucket(Bucket_ptr const b, unsigned int const id) { // returns 2 new Buckets
+        counters.Add(id, STAT_SPLIT_BUCKET);
+        const shared_ptr<BNode> bs = atomic_load(&b.b_ptr->state);
         shared_ptr<Bucket_ptr[]> res(new Bucket_ptr[2]);
 
-        shared_ptr<BState> bs0(new BState(bs->results, b.b_ptr->toggle));
-        shared_ptr<BState> bs1(new BState(bs->results, b.b_ptr->toggle));
-        shared_ptr<Bucket> res0(new Bucket((b.b_ptr->prefix << 1) + 0, b.b_ptr->depth + 1, bs0, b.b_ptr->toggle));
-        shared_ptr<Bucket> res1(new Bucket((b.b_ptr->prefix << 1) + 1, b.b_ptr->depth + 1, bs1, b.b_ptr->toggle));
-        res[0].b_ptr = res0;
-        res[1].b_ptr = res1;
+        // read once, a flip between two reads would leave a child whose toggle and applied bits differ
+        BigWord const toggle = b.b_ptr->toggle;
+        shared_ptr<BState> bs0 = NewBState(id, *bs, toggle);
+        shared_ptr<BState> bs1 = NewBState(id, *bs, toggle);
 
         // split the items between the next buckets
         for (int i = 0; i < BUCKET_SIZE; ++i) {
-            assert(bs->items[i].valid_item); // bucket should be full for splitting
-            if (Prefix(bs->items[i].hash, res[0].b_ptr->depth) == res[0].b_ptr->prefix)
-                bs0->InsertItem(bs->items[i]);
+            assert(bs->IsValid(i)); // bucket should be full for splitting
+            if (Prefix(bs->HashAt(i), b.b_ptr->depth + 1) == (b.b_ptr->prefix << 1))
+                bs0->InsertItem(*bs, i);
             else
-                bs1->InsertItem(bs->items[i]);
+                bs1->InsertItem(*bs, i);
         }
+        shared_ptr<Bucket> res0 = NewNode<Bucket>((b.b_ptr->prefix << 1) + 0, b.b_ptr->depth + 1, AsNode(bs0), toggle);
+        shared_ptr<Bucket> res1 = NewNode<Bucket>((b.b_ptr->prefix << 1) + 1, b.b_ptr->depth + 1, AsNode(bs1), toggle);
+        res[0].b_ptr = res0;
+        res[1].b_ptr = res1;
         return res;
     }
 
-    void DirectoryUpdate(DState &d, shared_ptr<Bucket_ptr[]> blist, Bucket_ptr const old_bucket) {
+    void DirectoryUpdate(DState &d, shared_ptr<Bucket_ptr[]> blist, Bucket_ptr const old_bucket, unsigned int const id) {
         int b_index = 0;
-        if (blist[b_index].b_ptr->depth > d.depth) d.EnlargeDir();
+        if (blist[b_index].b_ptr->depth > d.depth) {
+            d.EnlargeDir();
+            counters.Add(id, STAT_ENLARGE_DIR);
+        }
         for (size_t e = 0; e < POW(d.depth); ++e) {
             if (Prefix(e, blist[b_index].b_ptr->depth, d.depth) == blist[b_index].b_ptr->prefix) {
-                assert(atomic_load(&d.dir[e].b_ptr->state)->BucketAvailability() == FULL_BUCKET);
+                assert(atomic_load(&d.dir[e].b_ptr->state)->IsFull());
                 d.dir[e] = blist[b_index];
                 if (e + 1 < POW(d.depth) && Prefix(e + 1, blist[b_index].b_ptr->depth, d.depth) != blist[b_index].b_ptr->prefix) {
                     if (b_index == 0) b_index++; // blist[1] will always be right after blist[0]
@@ -327,48 +1315,147 @@ class hashmap {
         }
     }
 
-    void ApplyPendingResize(DState &d, Bucket const &bFull) {
-        for (int j = 0; j < NUMBER_OF_THREADS; ++j) {
-            Operation const temp_help_j = help[j]; // assignment constructor
+    // The ops that store their value when the key is absent
+    static bool AddsKey(Op_type const t) {
+        return t == INS || t == INS_IF_ABSENT || t == MERGE || t == EXCHANGE;
+    }
+
+    /* A full bucket that needs no split: replaces b in d by a copy without its
+     * expired items, or at capacity, for an op that adds an absent key,
+     * without the item CLOCK evicts. The copy goes in with the ht CAS like the
+     * buckets of a split, so b's frozen state is never changed.
+     * Returns how many items the copy dropped, 0 (d unchanged) if none. */
+    int CompactBucket(DState &d, Bucket_ptr const b, Operation const &op, unsigned int const id) {
+        uint64_t const now = Expiry::Now();
+        const shared_ptr<BNode> bs = atomic_load(&b.b_ptr->state);
+        bool const expired = Expiry::enabled && bs->HasExpired(now);
+        if (!expired && !(AtCapacity() && AddsKey(op.type) && bs->GetItem(op.key, op.hash) == NOT_FOUND))
+            return 0;
+
+        BigWord const toggle = b.b_ptr->toggle; // read once, as in SplitBucket
+        shared_ptr<BNode> next = NextState(id, bs);
+        next->SetApplied(toggle);
+        int const freed = expired ? next->PurgeExpired(now) : next->EvictOne(op.key, op.hash) != NOT_FOUND;
+        if (!freed) return 0;
+        Bucket_ptr compacted;
+        compacted.b_ptr = NewNode<Bucket>(b.b_ptr->prefix, b.b_ptr->depth, next, toggle);
+        for (size_t e = 0; e < POW(d.depth); ++e)
+            if (d.dir[e].b_ptr == b.b_ptr) d.dir[e] = compacted;
+        return freed;
+    }
+
+    // Returns how many items the buckets it put in d gained, less those compaction dropped
+    int ApplyPendingResize(DState &d, Bucket const &bFull, unsigned int const id) {
+        int items = 0;
+        for (unsigned int j = 0; j < NUMBER_OF_THREADS; ++j) {
+            shared_ptr<Operation const> const help_j = atomic_load(&help[j]);
+            Operation const &temp_help_j = *help_j; // the record is immutable
             if (temp_help_j.type != NONE && Prefix(temp_help_j.hash, bFull.depth) == bFull.prefix) {
-                BState const &bs = *(atomic_load(&bFull.state));
-                assert(bs.results[j].seqnum >= 0 && temp_help_j.seqnum >= 0);
-                if (bs.results[j].seqnum < temp_help_j.seqnum) {
+                BNode const &bs = *(atomic_load(&bFull.state));
+                assert(bs.ResultOf(j).seqnum >= 0 && temp_help_j.seqnum >= 0);
+                if (bs.ResultOf(j).seqnum < temp_help_j.seqnum) {
                     Bucket_ptr bDest = d.dir[Prefix(temp_help_j.hash, d.depth)];
-                    shared_ptr<BState> bsDest = atomic_load(&bDest.b_ptr->state);
-                    while (bsDest->BucketAvailability() == FULL_BUCKET) {
-                        shared_ptr<Bucket_ptr[]> const splitted = SplitBucket(bDest);
-                        DirectoryUpdate(d, splitted, bDest);
+                    shared_ptr<BNode> bsDest = atomic_load(&bDest.b_ptr->state);
+                    int freed = 0;
+                    while (bsDest->IsFull()) {
+                        int const compacted = CompactBucket(d, bDest, temp_help_j, id);
+                        if (compacted) {
+                            freed += compacted;
+                            items -= compacted;
+                        } else {
+                            shared_ptr<Bucket_ptr[]> const splitted = SplitBucket(bDest, id);
+                            DirectoryUpdate(d, splitted, bDest, id);
+                        }
                         bDest = d.dir[Prefix(temp_help_j.hash, d.depth)];
                         bsDest = atomic_load(&bDest.b_ptr->state);
                     }
-                    bsDest->results[j].status = ExecOnBucket(bsDest, temp_help_j);
-                    bsDest->results[j].seqnum = temp_help_j.seqnum;
+                    int const before = bsDest->Count();
+                    Status_type const status = ExecOnBucket(bsDest, temp_help_j, j, freed);
+                    items += bsDest->Count() - before;
+                    Result &res = bsDest->ResultFor(j);
+                    res.status = status;
+                    res.seqnum = temp_help_j.seqnum;
+                    if (j != id) counters.Add(id, STAT_HELPED);
                 }
             }
         }
+        return items;
     }
 
-    void ResizeWF() {
+    void ResizeWF(unsigned int const id) {
+        counters.Add(id, STAT_RESIZE);
         for (int k = 0; k < 2; ++k) {
             shared_ptr<DState> oldD = atomic_load(&ht);
             shared_ptr<DState> nextD(new DState(*oldD));
+            int items = 0;
 
             for (int j = 0; j < NUMBER_OF_THREADS; ++j) {
-                if (help[j].type != NONE) { // different from the paper cause we might have invalid op at help[j]
-                    Bucket_ptr b = nextD->dir[Prefix(help[j].hash, nextD->depth)];
-                    shared_ptr<BState> bs = (atomic_load(&b.b_ptr->state));
-                    if (bs->BucketAvailability() == FULL_BUCKET && bs->results[j].seqnum < help[j].seqnum) {
-                        ApplyPendingResize(*nextD, *b.b_ptr);
+                shared_ptr<Operation const> const op = atomic_load(&help[j]);
+                if (op->type != NONE) { // different from the paper cause we might have invalid op at help[j]
+                    Bucket_ptr b = nextD->dir[Prefix(op->hash, nextD->depth)];
+                    shared_ptr<BNode> bs = (atomic_load(&b.b_ptr->state));
+                    if (bs->IsFull() && bs->ResultOf(j).seqnum < op->seqnum) {
+                        items += ApplyPendingResize(*nextD, *b.b_ptr, id);
                     }
                 }
             }
 
-            if (atomic_compare_exchange_weak(&ht, &oldD, nextD))
+            if (atomic_compare_exchange_weak(&ht, &oldD, nextD)) {
+                counters.Add(id, STAT_RESIZE_SWAP);
+                AddSize(id, items);
                 return;
+            }
         }
     }
 
+    shared_ptr<BNode> StateOf(xxh::hash_t<32> const hashed_key) const {
+        shared_ptr<DState> htl = atomic_load(&ht);
+        return atomic_load(&htl->dir[Prefix(hashed_key, htl->getDepth())].b_ptr->state);
+    }
+
+    /* The slot of key in bs unless absent or expired (NOT_FOUND), in capacity
+     * mode the slot is marked referenced */
+    template<typename K>
+    int FindLive(BNode const &bs, K const &key, xxh::hash_t<32> const hashed_key) const {
+        int const i = bs.Find(key, hashed_key, equal);
+        if (i == NOT_FOUND || Expiry::Expired(bs.ExpiresAt(i), Expiry::Now())) return NOT_FOUND;
+        if (capacity.load(std::memory_order_relaxed)) bs.refs.Mark(i);
+        return i;
+    }
+
+    template<typename K>
+    std::pair<bool, Value> LookupHashed(K const &key, xxh::hash_t<32> const hashed_key) const {
+        shared_ptr<BNode> bs = StateOf(hashed_key);
+        int const i = FindLive(*bs, key, hashed_key);
+        if (i == NOT_FOUND) return {false, Value()};
+        return {true, ValueStorage::Get(bs->ValueAt(i))};
+    }
+
+    template<typename K>
+    shared_ptr<Value const> LookupShared(K const &key, xxh::hash_t<32> const hashed_key) const {
+        shared_ptr<BNode> bs = StateOf(hashed_key);
+        int const i = FindLive(*bs, key, hashed_key);
+        if (i == NOT_FOUND) return nullptr;
+        return ValueStorage::Share(bs->ValueAt(i));
+    }
+
+    // Hashes keys[0..n) with the Batch of the Hash policy if it has one
+    template<typename H = Hash>
+    auto HashBatch(Key const *keys, size_t const n, xxh::hash_t<32> *out, int) const
+    -> decltype(std::declval<H const &>().Batch(keys, n, out)) {
+        return hasher.Batch(keys, n, out);
+    }
+
+    void HashBatch(Key const *keys, size_t const n, xxh::hash_t<32> *out, long) const {
+        for (size_t i = 0; i < n; ++i) out[i] = hasher(keys[i]);
+    }
+
+    // In capacity mode with size_approx() at the capacity, full buckets evict
+    bool AtCapacity() const {
+        size_t const cap = capacity.load(std::memory_order_relaxed);
+        return cap && size_approx() >= cap;
+    }
+
     uint32_t Prefix(xxh::hash_t<32> const hash, uint32_t const depth) const {
         assert(depth);
         int shift = SIZE_OF_HASH - depth;
@@ -388,30 +1475,150 @@ class hashmap {
         return prefix;
     }
 
-    bool MakeOp(xxh::hash_t<32> hashed_key, unsigned int const id) {
+    /* One round of MakeOp: applies the op in help[id] to its bucket and
+     * resizes if that did not apply it. Returns the key's BState after it. */
+    shared_ptr<BNode> MakeOpRound(xxh::hash_t<32> hashed_key, unsigned int const id, bool const announce = true) {
+        shared_ptr<DState> htl = atomic_load(&ht);
+        uint32_t hash_prefix = Prefix(hashed_key, htl->getDepth());
+
+        ApplyWFOp(htl->dir[hash_prefix], id, announce);
+
+        htl = atomic_load(&ht);
+        shared_ptr<BNode> bstate = atomic_load(&htl->dir[hash_prefix].b_ptr->state);
+        assert(bstate->ResultOf(id).seqnum >= 0 && opSeqnum[id] >= 0);
+        if (bstate->ResultOf(id).seqnum != opSeqnum[id])
+            ResizeWF(id);
+
+        htl = atomic_load(&ht);
+        return atomic_load(&htl->dir[Prefix(hashed_key, htl->getDepth())].b_ptr->state);
+    }
+
+    // Returns the key's bucket state with the op in help[id] applied
+    shared_ptr<BNode> MakeOp(xxh::hash_t<32> hashed_key, unsigned int const id) {
         // this is a joint function for insert and remove
         // operation to do is in help[id]
         assert(0 <= id && id < NUMBER_OF_THREADS);
-        shared_ptr<BState> bstate;
+        shared_ptr<BNode> bstate;
         int run_times = 0;
         do {
-            shared_ptr<DState> htl = atomic_load(&ht);
-            uint32_t hash_prefix = Prefix(hashed_key, htl->getDepth());
+            bstate = MakeOpRound(hashed_key, id);
+            ++run_times;
+        }
+        while (bstate->ResultOf(id).seqnum != opSeqnum[id]);
+        counters.Add(id, STAT_MAKEOP_LOOPS, run_times);
+        return bstate;
+    }
 
-            ApplyWFOp(htl->dir[hash_prefix], id);
+    // Gives op the next seqnum of thread id and the hash of its key
+    void Stamp(unsigned int const id, Operation &op) {
+        assert(0 <= id && id < NUMBER_OF_THREADS);
+        ++opSeqnum[id];
+        op.seqnum = opSeqnum[id];
+        op.hash = hasher(op.key);
+    }
 
-            htl = atomic_load(&ht);
-            bstate = atomic_load(&htl->dir[hash_prefix].b_ptr->state);
-            assert(bstate->results[id].seqnum >= 0 && opSeqnum[id] >= 0);
-            if (bstate->results[id].seqnum != opSeqnum[id])
-                ResizeWF();
+    // Publishes a stamped op as the op record of thread id in help[id], returns its hash
+    xxh::hash_t<32> Publish(unsigned int const id, Operation op) {
+        xxh::hash_t<32> hashed_key(op.hash);
+        atomic_store(&help[id], make_shared<Operation const>(std::move(op)));
+        return hashed_key;
+    }
 
-            htl = atomic_load(&ht);
-            bstate = atomic_load(&htl->dir[Prefix(hashed_key, htl->getDepth())].b_ptr->state);
-            ++run_times;
+    /* The fast path of a stamped op (Kogan-Petrank fast-path-slow-path): up
+     * to FAST_PATH_ATTEMPTS copy-and-CAS rounds of its bucket state with the
+     * op applied, not announced in help[id] nor toggled. Each round applies
+     * the ops already announced on the bucket first, like an ApplyWFOp round,
+     * so fast ops that win the CAS help the slow ones and the two rounds of
+     * ApplyWFOp still suffice. Full states (splits) are left to the slow path.
+     * Returns false, with nothing applied, when every round lost, else sets
+     * out to the state it published. */
+    bool FastPath(unsigned int const id, Operation const &op, shared_ptr<BNode> &out) {
+        for (int i = 0; i < FAST_PATH_ATTEMPTS; ++i) {
+            shared_ptr<DState> htl = atomic_load(&ht);
+            Bucket_ptr const b = htl->dir[Prefix(op.hash, htl->getDepth())];
+            shared_ptr<BNode> oldBState = atomic_load(&b.b_ptr->state);
+            // htl may be stale, but a bucket leaves the directory only with a
+            // full state, which never changes, so a CAS from a state with room
+            // cannot land on a bucket a resize has replaced
+            if (oldBState->IsFull()) return false;
+            shared_ptr<BNode> nextBState = NextState(id, oldBState);
+            BigWord const toggle = b.b_ptr->toggle;
+            ApplyPending(nextBState, *b.b_ptr, toggle, id);
+            Status_type const status = ExecOnBucket(nextBState, op, id);
+            if (status == FAIL) return false; // the pending ops filled the state
+            Result &res = nextBState->ResultFor(id);
+            res.status = status;
+            res.seqnum = op.seqnum;
+            int const items = nextBState->Count() - oldBState->Count();
+            if (atomic_compare_exchange_weak(&b.b_ptr->state, &oldBState, nextBState)) {
+                counters.Add(id, STAT_CAS_SUCCESS);
+                counters.Add(id, STAT_FAST_PATH);
+                AddSize(id, items);
+                out = nextBState;
+                return true;
+            }
+            counters.Add(id, STAT_CAS_FAILURE);
         }
-        while (bstate->results[id].seqnum != opSeqnum[id]);
-        return true;
+        return false;
+    }
+
+    /* Runs op on the fast path, else publishes it in help[id] and runs it on
+     * the slow path, returns its Result and, if seen is given, takes the value
+     * it reported. Submitted ops of id hold help[id] and are completed first. */
+    Result RunOp(unsigned int const id, Operation op, std::optional<Value> *const seen = nullptr) {
+        drain(id);
+        Stamp(id, op);
+        int const seqnum = op.seqnum;
+        shared_ptr<BNode> bstate;
+        if (!FastPath(id, op, bstate))
+            bstate = MakeOp(Publish(id, std::move(op)), id);
+        if (seen) {
+            Report const *const r = bstate->ReportOf(id, seqnum);
+            if (r) {
+                *seen = ValueStorage::Get(r->prior);
+                r->taken.store(true, std::memory_order_relaxed); // the next report here drops it
+            }
+        }
+        return bstate->ResultOf(id);
+    }
+
+    /* Publishes the oldest submitted op of id and flips the toggle bit of id in
+     * its bucket, so any thread that works on the bucket applies it too */
+    void AnnounceFront(unsigned int const id) {
+        SubmitQueue &q = submitted[id];
+        Submitted &s = q.ops.front();
+        Stamp(id, s.op);
+        s.hash = Publish(id, std::move(s.op));
+        shared_ptr<DState> htl = atomic_load(&ht);
+        htl->dir[Prefix(s.hash, htl->getDepth())].b_ptr->toggle.FlipBit(id);
+        q.flipped = true;
+    }
+
+    Submitted &Enqueue(unsigned int const id, Operation op) {
+        assert(0 <= id && id < NUMBER_OF_THREADS);
+        SubmitQueue &q = submitted[id];
+        while (q.ops.size() == SUBMIT_QUEUE_SIZE)
+            progress(id);
+        q.ops.emplace_back(std::move(op));
+        if (q.ops.size() == 1) AnnounceFront(id);
+        return q.ops.back();
+    }
+
+    void AddSize(unsigned int const id, int64_t const delta) {
+        if (!delta) return;
+        std::atomic<int64_t> &n = sizeDelta[id].n;
+        n.store(n.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    // Runs op, returns whether it took effect and the value it saw
+    std::pair<bool, std::optional<Value>> Outcome(unsigned int const id, Operation op) {
+        std::optional<Value> seen;
+        bool const done = RunOp(id, std::move(op), &seen).status == TRUE;
+        return {done, std::move(seen)};
+    }
+
+    static bool OperatorEqual(Value const &a, Value const &b) {
+        return a == b;
     }
 
 public:
@@ -419,6 +1626,8 @@ public:
     hashmap() {
         atomic_store(&ht, make_shared<DState>());
         for (unsigned long long &i : opSeqnum) i = 0;
+        shared_ptr<Operation const> const none = make_shared<Operation const>();
+        for (shared_ptr<Operation const> &op : help) atomic_store(&op, none);
     };
 
     hashmap(hashmap &) = delete;
@@ -428,33 +1637,158 @@ public:
     ~hashmap() = default;
 
     std::pair<bool, Value> lookup(Key const &key) const &{
-        const void *kptr = &key;
-        xxh::hash_t<32> hashed_key(xxh::xxhash<32>(kptr, sizeof(Key)));
+        if (Stats::enabled) counters.Add(hashmap_stats::LocalSlot(), STAT_LOOKUP);
+        return LookupHashed(key, hasher(key));
+    }
+
+    /* lookup for any K that a transparent Hash and KeyEqual accept, e.g. a
+     * std::string_view or a const char* into a byte_key map, no Key is built */
+    template<typename K, typename H = Hash, typename E = KeyEqual,
+            typename = typename H::is_transparent, typename = typename E::is_transparent>
+    std::pair<bool, Value> find(K const &key) const &{
+        if (Stats::enabled) counters.Add(hashmap_stats::LocalSlot(), STAT_LOOKUP);
+        return LookupHashed(key, hasher(key));
+    }
+
+    /* Looks up keys[0..n) into out[0..n), as n lookups would, and returns how
+     * many were found. Every LOOKUP_BATCH_SIZE keys are hashed first and then
+     * taken through the directory, Bucket and BState levels one level at a
+     * time, prefetching the next level of all of them, so the cache misses of
+     * the batch overlap instead of forming one chain per key. The batch reads
+     * one DState. */
+    size_t lookup_batch(Key const *keys, size_t const n, std::pair<bool, Value> *out) const {
+        if (Stats::enabled) counters.Add(hashmap_stats::LocalSlot(), STAT_LOOKUP, n);
         shared_ptr<DState> htl = atomic_load(&ht);
-        size_t hash_prefix = Prefix(hashed_key, htl->getDepth());
-        shared_ptr<BState> bs = atomic_load(&htl->dir[hash_prefix].b_ptr->state);
-        for (Triple t : bs->items) {
-            if (t.valid_item && t.key == key) return {true, t.value};
+        size_t const depth = htl->getDepth();
+        Bucket_ptr const *dir = htl->dir.get(); // a published directory is not modified, htl keeps it
+        size_t found = 0;
+        for (size_t first = 0; first < n; first += LOOKUP_BATCH_SIZE) {
+            size_t const m = std::min<size_t>(LOOKUP_BATCH_SIZE, n - first);
+            xxh::hash_t<32> hashes[LOOKUP_BATCH_SIZE];
+            Bucket const *buckets[LOOKUP_BATCH_SIZE];
+            shared_ptr<BNode> states[LOOKUP_BATCH_SIZE];
+            HashBatch(keys + first, m, hashes, 0);
+            for (size_t i = 0; i < m; ++i)
+                __builtin_prefetch(&dir[Prefix(hashes[i], depth)]);
+            for (size_t i = 0; i < m; ++i) {
+                buckets[i] = dir[Prefix(hashes[i], depth)].b_ptr.get();
+                __builtin_prefetch(buckets[i]);
+            }
+            for (size_t i = 0; i < m; ++i) {
+                states[i] = atomic_load(&buckets[i]->state);
+                __builtin_prefetch(&states[i]->occupied);
+            }
+            for (size_t i = 0; i < m; ++i) {
+                int const slot = FindLive(*states[i], keys[first + i], hashes[i]);
+                out[first + i] = slot == NOT_FOUND ? std::pair<bool, Value>(false, Value())
+                                                   : std::pair<bool, Value>(true, ValueStorage::Get(states[i]->ValueAt(slot)));
+                found += slot != NOT_FOUND;
+            }
         }
-        return {false, Value()};
+        return found;
+    }
+
+    /* The stored Value itself (nullptr if absent) under indirect storage, it
+     * stays valid and unchanged after the key is updated or removed; a
+     * shared copy under inline storage */
+    shared_ptr<Value const> lookup_shared(Key const &key) const {
+        if (Stats::enabled) counters.Add(hashmap_stats::LocalSlot(), STAT_LOOKUP);
+        return LookupShared(key, hasher(key));
     }
 
     bool insert(Key const &key, Value const &value, unsigned int const id) {
-        assert(0 <= id && id < NUMBER_OF_THREADS);
-        ++opSeqnum[id];
-        const void *kptr = &key;
-        xxh::hash_t<32> hashed_key(xxh::xxhash<32>(kptr, sizeof(Key)));
-        help[id] = Operation(INS, key, value, opSeqnum[id], hashed_key);
-        return MakeOp(hashed_key, id);
+        counters.Add(id, STAT_INSERT);
+        return RunOp(id, Operation(INS, key, ValueStorage::Make(value))).status == TRUE;
+    }
+
+    bool insert(Key &&key, Value &&value, unsigned int const id) {
+        counters.Add(id, STAT_INSERT);
+        return RunOp(id, Operation(INS, std::move(key), ValueStorage::Make(std::move(value)))).status == TRUE;
+    }
+
+    /* Inserts or updates key with a Value constructed from args. The thread id
+     * comes first here, the arguments after the key are the Value's. */
+    template<typename... Args>
+    bool emplace(unsigned int const id, Key key, Args &&... args) {
+        counters.Add(id, STAT_INSERT);
+        return RunOp(id, Operation(INS, std::move(key), ValueStorage::Make(std::forward<Args>(args)...))).status == TRUE;
+    }
+
+    /* Inserts only if key is absent and returns whether it did. A present key
+     * is answered by a lookup, without building the Value or an op record. */
+    template<typename... Args>
+    bool try_emplace(unsigned int const id, Key key, Args &&... args) {
+        counters.Add(id, STAT_INSERT);
+        if (LookupHashed(key, hasher(key)).first) return false;
+        return RunOp(id, Operation(INS_IF_ABSENT, std::move(key), ValueStorage::Make(std::forward<Args>(args)...))).status == TRUE;
+    }
+
+    /*** Conditional operations ***/
+    /**Each takes effect atomically only if its condition holds and returns
+     * {took effect, the value of key just before it, nullopt if absent}.
+     * compare_and_swap and remove_if_equal compare values with operator==.
+     * **/
+    std::pair<bool, std::optional<Value>> insert_if_absent(Key const &key, Value const &value, unsigned int const id) {
+        counters.Add(id, STAT_INSERT);
+        return Outcome(id, Operation(INS_IF_ABSENT, key, ValueStorage::Make(value)));
+    }
+
+    std::pair<bool, std::optional<Value>> replace_if_present(Key const &key, Value const &value, unsigned int const id) {
+        counters.Add(id, STAT_INSERT);
+        return Outcome(id, Operation(REPLACE_IF_PRESENT, key, ValueStorage::Make(value)));
+    }
+
+    std::pair<bool, std::optional<Value>> compare_and_swap(Key const &key, Value const &expected,
+                                                           Value const &desired, unsigned int const id) {
+        counters.Add(id, STAT_INSERT);
+        Operation op(COMPARE_AND_SWAP, key, ValueStorage::Make(desired));
+        op.expected = ValueStorage::Make(expected);
+        op.value_equal = OperatorEqual;
+        return Outcome(id, std::move(op));
+    }
+
+    std::pair<bool, std::optional<Value>> remove_if_equal(Key const &key, Value const &expected, unsigned int const id) {
+        counters.Add(id, STAT_REMOVE);
+        Operation op(REMOVE_IF_EQUAL, key);
+        op.expected = ValueStorage::Make(expected);
+        op.value_equal = OperatorEqual;
+        return Outcome(id, std::move(op));
+    }
+
+    /*** Read-modify-write ***/
+    /**Applied by ExecOnBucket inside the next BState, so concurrent merges of a
+     * key are linearizable and pending merges to one bucket are combined in a
+     * single copy-and-CAS. The functors run on helper threads too and maybe
+     * more than once, they must be deterministic and free of side effects.
+     * All return the value of key before the operation, nullopt if absent.
+     * @merge - stores delta if key is absent, else fn(old value, delta).
+     * @upsert - stores init if key is absent, else fn(old value).
+     * @fetch_add - merge with +.
+     * **/
+    template<typename MergeFn>
+    std::optional<Value> merge(Key const &key, Value const &delta, MergeFn fn, unsigned int const id) {
+        counters.Add(id, STAT_INSERT);
+        Operation op(MERGE, key, ValueStorage::Make(delta));
+        op.combine = std::move(fn);
+        return Outcome(id, std::move(op)).second;
+    }
+
+    template<typename UpdateFn>
+    std::optional<Value> upsert(Key const &key, Value const &init, UpdateFn fn, unsigned int const id) {
+        return merge(key, init, [fn](Value const &old, Value const &) { return fn(old); }, id);
+    }
+
+    std::optional<Value> fetch_add(Key const &key, Value const &delta, unsigned int const id) {
+        return merge(key, delta, std::plus<Value>(), id);
     }
 
     void DebugPrintDir() const {
         std::cout << std::endl;
         auto htl = atomic_load(&ht);
-        for (int i = 0; i < POW(htl->depth); i++) {
-            BState *bs = atomic_load(&htl->dir[i].b_ptr->state);
+        for (size_t i = 0; i < POW(htl->depth); i++) {
+            shared_ptr<BNode> bs = atomic_load(&htl->dir[i].b_ptr->state);
             std::cout << "Entries: [" << i << ",";
-            while (i + 1 < POW(htl->depth) && htl->dir[i] == htl->dir[i + 1])
+            while (i + 1 < POW(htl->depth) && htl->dir[i].b_ptr == htl->dir[i + 1].b_ptr)
                 i++;
             if (i + 1 < POW(htl->depth))
                 assert(htl->dir[i].b_ptr->depth != htl->dir[i + 1].b_ptr->depth ||
@@ -464,24 +1798,247 @@ public:
                 std::cout << ((htl->dir[i].b_ptr->prefix >> k) & 1);
             std::cout << ".\tItems: " << std::endl;
             for (int j = 0; j < BUCKET_SIZE; j++) {
-                if (bs->items[j] != nullptr) {
+                if (bs->IsValid(j)) {
                     std::cout << "\t\t" << "(hash: "
-                              << std::bitset<SIZE_OF_HASH>(bs->items[j]->hash)
-                              << ")\t\tvalue: " << bs->items[j]->value
-                              << "\tkey: " << bs->items[j]->key << std::endl;
+                              << std::bitset<SIZE_OF_HASH>(bs->HashAt(j))
+                              << ")\t\tvalue: " << ValueStorage::Get(bs->ValueAt(j))
+                              << "\tkey: " << bs->KeyAt(j) << std::endl;
                 }
             }
         }
     }
 
-    bool remove(Key const &key, unsigned int const id) {
+    /* Walks the current directory once (O(directory), one slot scan per bucket) */
+    hashmap_layout_report layout_report() const {
+        hashmap_layout_report r;
+        shared_ptr<DState> htl = atomic_load(&ht);
+        size_t const dir_size = POW(htl->depth);
+        r.global_depth = htl->depth;
+        r.directory_bytes = sizeof(DState) + dir_size * sizeof(Bucket_ptr);
+
+        size_t e = 0;
+        while (e < dir_size) {
+            Bucket const *b = htl->dir[e].b_ptr.get();
+            size_t run = 1;
+            while (e + run < dir_size && htl->dir[e + run].b_ptr.get() == b)
+                ++run;
+            if (run > r.longest_run) r.longest_run = run;
+            e += run;
+
+            shared_ptr<BNode> bs = atomic_load(&b->state);
+            size_t occupied = bs->Count();
+            for (uint64_t m = bs->occupied; m; m &= m - 1)
+                r.value_bytes += ValueStorage::OutOfLineBytes(bs->ValueAt(__builtin_ctzll(m)));
+
+            r.unique_buckets++;
+            r.items += occupied;
+            r.local_depth_hist[b->depth]++;
+            r.occupancy_hist[occupied]++;
+            r.bucket_bytes += sizeof(Bucket);
+            r.bstate_bytes += bs->Bytes();
+        }
+        return r;
+    }
+
+    /* insert, the item expires ttl from now (Expiry must be hashmap_expiry) */
+    bool insert_for(Key const &key, Value const &value, std::chrono::nanoseconds const ttl, unsigned int const id) {
+        static_assert(Expiry::enabled, "insert_for needs the hashmap_expiry policy, see hashmap_ttl");
+        counters.Add(id, STAT_INSERT);
+        Operation op(INS, key, ValueStorage::Make(value));
+        op.expires = Expiry::After(ttl);
+        return RunOp(id, std::move(op)).status == TRUE;
+    }
+
+    /* Purges the expired items of up to max_buckets buckets, continuing where
+     * the last call stopped, one copy-and-CAS per bucket that has any. Meant
+     * for a background thread (with its own id) or an idle loop. Returns the
+     * number of purged items. */
+    size_t sweep(size_t const max_buckets, unsigned int const id) {
+        static_assert(Expiry::enabled, "sweep needs the hashmap_expiry policy, see hashmap_ttl");
         assert(0 <= id && id < NUMBER_OF_THREADS);
-        ++opSeqnum[id];
-        const void *kptr = &key;
-        xxh::hash_t<32> hashed_key(xxh::xxhash<32>(kptr, sizeof(Key)));
-        help[id] = Operation(DEL, key, opSeqnum[id], hashed_key);
-        return MakeOp(hashed_key, id);
+        shared_ptr<DState> htl = atomic_load(&ht);
+        size_t const dir_size = POW(htl->depth);
+        size_t e = sweepCursor.load(std::memory_order_relaxed) % dir_size;
+        while (e > 0 && htl->dir[e - 1].b_ptr == htl->dir[e].b_ptr) --e; // start at the bucket's first entry
+        size_t purged = 0;
+        for (size_t n = 0; n < max_buckets; ++n) {
+            Bucket_ptr const b = htl->dir[e];
+            purged += SweepBucket(b, id);
+            do {
+                e = (e + 1) % dir_size;
+            } while (e != 0 && htl->dir[e].b_ptr == b.b_ptr); // entries of a bucket are adjacent
+        }
+        sweepCursor.store(e, std::memory_order_relaxed);
+        return purged;
+    }
+
+    /* Returns whether key was present */
+    bool remove(Key const &key, unsigned int const id) {
+        counters.Add(id, STAT_REMOVE);
+        return RunOp(id, Operation(DEL, key)).status == TRUE;
+    }
+
+    /* Stores value and returns the value it replaced, nullopt if key was absent */
+    std::optional<Value> exchange(Key const &key, Value const &value, unsigned int const id) {
+        counters.Add(id, STAT_INSERT);
+        return Outcome(id, Operation(EXCHANGE, key, ValueStorage::Make(value))).second;
+    }
+
+    /* Removes key and returns its value, nullopt if it was absent */
+    std::optional<Value> take(Key const &key, unsigned int const id) {
+        counters.Add(id, STAT_REMOVE);
+        return Outcome(id, Operation(TAKE, key)).second;
+    }
+
+    /*** Asynchronous operations ***/
+    /**submit_insert and submit_remove announce the op and return at once, the
+     * future gets what insert / remove would have returned. A thread id keeps
+     * up to SUBMIT_QUEUE_SIZE submitted ops in order; the oldest one is in
+     * help[id], where any thread working on its bucket may apply it, the
+     * others wait in the queue (the protocol has one op record per id).
+     * progress(id) runs one helping round for the oldest op and completes it
+     * once applied, only the owner of id calls it. Submitting to a full queue,
+     * and any blocking op of id, first run progress(id) until there is room
+     * or the queue is empty.
+     * **/
+    std::future<bool> submit_insert(Key const &key, Value const &value, unsigned int const id) {
+        counters.Add(id, STAT_INSERT);
+        return Enqueue(id, Operation(INS, key, ValueStorage::Make(value))).done.get_future();
+    }
+
+    std::future<bool> submit_remove(Key const &key, unsigned int const id) {
+        counters.Add(id, STAT_REMOVE);
+        return Enqueue(id, Operation(DEL, key)).done.get_future();
+    }
+
+    // Returns the number of ops it completed, 0 or 1
+    size_t progress(unsigned int const id) {
+        SubmitQueue &q = submitted[id];
+        if (q.ops.empty()) return 0;
+        Submitted &s = q.ops.front();
+        int const seqnum = (int) opSeqnum[id]; // of the front op, Results keep seqnums as int
+        shared_ptr<BNode> bstate = StateOf(s.hash);
+        if (bstate->ResultOf(id).seqnum != seqnum) { // not applied by a helper yet
+            bstate = MakeOpRound(s.hash, id, !q.flipped);
+            q.flipped = false;
+            counters.Add(id, STAT_MAKEOP_LOOPS);
+            if (bstate->ResultOf(id).seqnum != seqnum) return 0;
+        }
+        s.done.set_value(bstate->ResultOf(id).status == TRUE);
+        void (*const resume)(void *) = s.resume;
+        void *const resume_arg = s.resume_arg;
+        q.ops.pop_front();
+        if (!q.ops.empty()) AnnounceFront(id);
+        if (resume) resume(resume_arg); // last, the coroutine may submit again
+        return 1;
+    }
+
+    void drain(unsigned int const id) {
+        while (!submitted[id].ops.empty())
+            progress(id);
+    }
+
+    size_t pending(unsigned int const id) const {
+        return submitted[id].ops.size();
+    }
+
+#ifdef HASHMAP_COROUTINES
+    /* co_await m.async_insert(key, value, id) in a coroutine on the thread of
+     * id, whose event loop calls progress(id); progress resumes the coroutine
+     * when the op completes */
+    class op_awaiter {
+        Submitted *entry;
+        std::future<bool> result;
+
+    public:
+        explicit op_awaiter(Submitted &s) : entry(&s), result(s.done.get_future()) {}
+
+        bool await_ready() const {
+            return result.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }
+
+        void await_suspend(std::coroutine_handle<> h) {
+            entry->resume = [](void *address) { std::coroutine_handle<>::from_address(address).resume(); };
+            entry->resume_arg = h.address();
+        }
+
+        bool await_resume() {
+            return result.get();
+        }
+    };
+
+    op_awaiter async_insert(Key const &key, Value const &value, unsigned int const id) {
+        counters.Add(id, STAT_INSERT);
+        return op_awaiter(Enqueue(id, Operation(INS, key, ValueStorage::Make(value))));
+    }
+
+    op_awaiter async_remove(Key const &key, unsigned int const id) {
+        counters.Add(id, STAT_REMOVE);
+        return op_awaiter(Enqueue(id, Operation(DEL, key)));
+    }
+#endif
+
+    /* Sums the item counts of the buckets of the current directory, exact when
+     * no update runs concurrently (O(directory)) */
+    size_t size() const {
+        shared_ptr<DState> htl = atomic_load(&ht);
+        size_t const dir_size = POW(htl->depth);
+        size_t res = 0;
+        for (size_t e = 0; e < dir_size; ++e) {
+            Bucket const *b = htl->dir[e].b_ptr.get();
+            if (e > 0 && htl->dir[e - 1].b_ptr.get() == b) continue; // entries of a bucket are adjacent
+            res += atomic_load(&b->state)->Count();
+        }
+        return res;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    /* Sums the per-thread deltas (O(threads), no shared writes), may lag
+     * behind ops that are still running */
+    size_t size_approx() const {
+        int64_t res = 0;
+        for (SizeDelta const &d : sizeDelta)
+            res += d.n.load(std::memory_order_relaxed);
+        return res > 0 ? (size_t) res : 0;
+    }
+
+    /*** Capacity mode ***/
+    /**With a capacity set, an operation that adds a key while size_approx()
+     * is at the capacity first evicts another item of the key's bucket, and a
+     * full bucket is never split, so the table stops growing and serves as a
+     * fixed footprint cache. The victim is chosen CLOCK style by per-slot
+     * reference bits that lookups set, a new item starts unreferenced. The
+     * bound is approximate under concurrent inserts. 0 turns the mode off.
+     * **/
+    void set_capacity(size_t const max_items) {
+        capacity.store(max_items, std::memory_order_relaxed);
+    }
+
+    size_t get_capacity() const {
+        return capacity.load(std::memory_order_relaxed);
+    }
+
+    size_t global_depth() const {
+        return atomic_load(&ht)->getDepth();
+    }
+
+    /* Sums the per-thread counters, all zero unless Stats is hashmap_stats */
+    hashmap_stats_snapshot stats() const {
+        return counters.Snapshot();
     }
 };
 
+// A hashmap whose items can expire, see insert_for and sweep
+template<typename Key, typename Value, typename Stats = hashmap_no_stats>
+using hashmap_ttl = hashmap<Key, Value, Stats, hashmap_hash<Key>, hashmap_equal<Key>,
+        hashmap_value_storage<Value>, hashmap_expiry>;
+
+// A hashmap whose bucket states use ChainLength (0 copies), whatever the default
+template<typename Key, typename Value, int ChainLength, typename Stats = hashmap_no_stats>
+using hashmap_delta = hashmap<Key, Value, Stats, hashmap_hash<Key>, hashmap_equal<Key>,
+        hashmap_value_storage<Value>, hashmap_no_expiry, hashmap_bucket_states<ChainLength>>;
+
 #endif //EWRHT_HASHMAP_H
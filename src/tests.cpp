@@ -1,5 +1,6 @@
 #include <iostream>
 #include "hashmap.h"
+#include "trace.h"
 #include <pthread.h>
 #include <unistd.h> // for sleep
 
@@ -42,6 +43,536 @@ void *thead_function(void *threadarg) {
     return nullptr;
 }
 
+struct session {
+    char data[1024];
+    int id;
+
+    session() : data(), id(-1) {}
+
+    explicit session(int id) : data(), id(id) {}
+};
+
+void test25() {
+    hashmap<int, int, hashmap_stats> m{};
+    const int test_len = 20 * BUCKET_SIZE;
+    for (int i = 0; i < test_len; ++i)
+        assert(m.insert(i, i, i % 4));
+    hashmap_stats_snapshot s = m.stats();
+    assert(s[STAT_FAST_PATH] + s[STAT_MAKEOP_LOOPS] >= test_len);
+#if FAST_PATH_ATTEMPTS
+    assert(s[STAT_FAST_PATH] > 0 && s[STAT_SPLIT_BUCKET] > 0); // full states take the slow path
+#else
+    assert(s[STAT_FAST_PATH] == 0);
+#endif
+
+    // a fast op applies the announced ones on its bucket
+    uint64_t const helped = m.stats()[STAT_HELPED];
+    std::future<bool> removed = m.submit_remove(0, 5);
+    for (int i = 1; m.lookup(0).first; ++i) // until a remove lands on the bucket of 0
+        assert(m.remove(i, 6));
+    assert(m.stats()[STAT_HELPED] == helped + 1);
+    m.drain(5);
+    assert(removed.get() && !m.lookup(0).first);
+    for (int i = 0; i < test_len; ++i)
+        m.remove(i, 7);
+    assert(m.size() == 0 && m.size_approx() == 0);
+    cout << "Test #25 Finished!" << endl;
+}
+
+// Returns the bucket state bytes the writes allocated
+template<int ChainLength>
+uint64_t test24_states() {
+    hashmap_delta<int, int, ChainLength, hashmap_stats> m{};
+    int expected[30] = {}; // 0 is absent
+    for (int round = 0; round < 10 * (ChainLength + 2); ++round) { // many writes per state
+        for (int k = 0; k < 30; ++k) {
+            unsigned int const id = (unsigned int) (k + round) % NUMBER_OF_THREADS;
+            if ((k + round) % 7 == 0) {
+                assert(m.remove(k, id) == (expected[k] != 0));
+                expected[k] = 0;
+            } else if (expected[k] && round % 2) {
+                assert(*m.fetch_add(k, 1, id) == expected[k]);
+                expected[k] += 1;
+            } else {
+                m.insert(k, round + 1, id);
+                expected[k] = round + 1;
+            }
+        }
+        size_t present = 0;
+        for (int k = 0; k < 30; ++k) {
+            assert(m.lookup(k) == (expected[k] ? std::make_pair(true, expected[k]) : std::make_pair(false, 0)));
+            present += expected[k] != 0;
+        }
+        assert(m.size() == present);
+    }
+    for (int i = 30; i < 20 * BUCKET_SIZE; ++i) // splits the states after many writes
+        m.insert(i, i, 0);
+    for (int k = 0; k < 30; ++k)
+        assert(m.lookup(k).first == (expected[k] != 0));
+    return m.stats()[STAT_BSTATE_BYTES];
+}
+
+void test24() {
+    uint64_t const copied = test24_states<0>(); // the copy engine
+    test24_states<1>(); // a new base every other write
+    uint64_t const deltas = test24_states<8>();
+    assert(deltas < copied);
+    cout << "Test #24 Finished!" << endl;
+}
+
+void test23() {
+    std::vector<int> ints;
+    std::vector<uint64_t> longs;
+    for (int i = -500; i < 500; ++i) {
+        ints.push_back(i * 7919);
+        longs.push_back((uint64_t) i * 0x9E3779B97F4A7C15ULL);
+    }
+    std::vector<xxh::hash_t<32>> out(ints.size());
+    for (size_t n : {(size_t) 0, (size_t) 5, (size_t) 37, ints.size()}) { // full vectors and tails
+        hashmap_hash<int>().Batch(ints.data(), n, out.data());
+        for (size_t i = 0; i < n; ++i) assert(out[i] == hashmap_hash<int>()(ints[i]));
+        hashmap_hash<uint64_t>().Batch(longs.data(), n, out.data());
+        for (size_t i = 0; i < n; ++i) assert(out[i] == hashmap_hash<uint64_t>()(longs[i]));
+    }
+    std::string words[3] = {"a", "bb", "ccc"}; // no Batch, lookup_batch hashes one by one
+    hashmap<std::string, int> m{};
+    m.insert(words[1], 2, 0);
+    std::pair<bool, int> found[3];
+    assert(m.lookup_batch(words, 3, found) == 1 && found[1].second == 2 && !found[2].first);
+    cout << "Test #23 Finished!" << endl;
+}
+
+void test22() {
+    hashmap<int, int> m{};
+    for (int i = 0; i < 20 * BUCKET_SIZE; i += 2) // resizes
+        m.insert(i, -i, 0);
+    std::vector<int> keys;
+    for (int i = 0; i < 20 * BUCKET_SIZE + 5; ++i) // a partial batch at the end
+        keys.push_back(i);
+    std::vector<std::pair<bool, int>> out(keys.size());
+    assert(m.lookup_batch(keys.data(), keys.size(), out.data()) == 10 * BUCKET_SIZE);
+    for (size_t i = 0; i < keys.size(); ++i)
+        assert(out[i] == m.lookup(keys[i]));
+    assert(m.lookup_batch(keys.data(), 0, out.data()) == 0);
+    cout << "Test #22 Finished!" << endl;
+}
+
+#ifdef HASHMAP_COROUTINES
+struct detached_task { // starts at once, nothing to await
+    struct promise_type {
+        detached_task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+detached_task async_insert_then_remove(hashmap<int, int> &m, int key, int &done) {
+    bool inserted = co_await m.async_insert(key, key, 2);
+    bool removed = co_await m.async_remove(key, 2);
+    done += inserted && removed;
+}
+#endif
+
+void test21() {
+    hashmap<int, int, hashmap_stats> m{};
+    std::vector<std::future<bool>> inserted;
+    for (int i = 0; i < 3 * SUBMIT_QUEUE_SIZE; ++i) // more than a queue, submit makes room
+        inserted.push_back(m.submit_insert(i, i, 0));
+    assert(m.pending(0) <= SUBMIT_QUEUE_SIZE);
+    while (m.pending(0)) m.progress(0);
+    for (int i = 0; i < 3 * SUBMIT_QUEUE_SIZE; ++i)
+        assert(inserted[i].get() && m.lookup(i).second == i);
+
+    // an op of another thread on the bucket applies the submitted one
+    int same_bucket = 1;
+    while (hashmap_hash<int>()(same_bucket) >> (SIZE_OF_HASH - 1) != hashmap_hash<int>()(-1) >> (SIZE_OF_HASH - 1))
+        ++same_bucket;
+    std::future<bool> removed = m.submit_remove(-1, 0), removed_too = m.submit_remove(0, 0);
+    m.insert(same_bucket + 1000, 0, 1);
+    assert(m.stats()[STAT_HELPED] >= 1);
+    assert(m.progress(0) == 1 && !removed.get()); // -1 was never there
+    m.drain(0);
+    assert(removed_too.get() && !m.lookup(0).first && m.size() == 3 * SUBMIT_QUEUE_SIZE);
+    assert(m.size_approx() == m.size());
+
+    m.submit_insert(0, 0, 0);
+    m.insert(1, -1, 0); // a blocking op completes the submitted ones first
+    assert(m.pending(0) == 0 && m.lookup(0).first);
+
+#ifdef HASHMAP_COROUTINES
+    hashmap<int, int> c{};
+    int done = 0;
+    for (int k = 0; k < 4; ++k) async_insert_then_remove(c, k, done);
+    while (c.pending(2)) c.progress(2);
+    assert(done == 4 && c.size() == 0);
+#endif
+    cout << "Test #21 Finished!" << endl;
+}
+
+void test20() {
+    hashmap<int, int, hashmap_stats> m{};
+    m.set_capacity(BUCKET_SIZE);
+    assert(m.get_capacity() == BUCKET_SIZE);
+    for (int i = 0; i < BUCKET_SIZE / 2; ++i)
+        m.insert(i, i, 0);
+    size_t const depth = m.global_depth();
+    for (int i = BUCKET_SIZE / 2; i < 20 * BUCKET_SIZE; ++i) {
+        m.insert(i, i, 0);
+        assert(m.lookup(0).first); // looked up after every insert, never the victim
+    }
+    assert(m.size() <= BUCKET_SIZE && m.size() == m.size_approx());
+    assert(m.global_depth() == depth);
+    assert(m.lookup(20 * BUCKET_SIZE - 1).first); // the newest key is in
+    m.insert(0, -1, 0); // an update evicts nothing
+    assert(m.lookup(0).second == -1 && m.size() <= BUCKET_SIZE);
+
+    m.set_capacity(0); // unbounded again, the table grows
+    for (int i = 0; i < 4 * BUCKET_SIZE; ++i)
+        m.insert(-1 - i, i, 0);
+    assert(m.size() >= 4 * BUCKET_SIZE && m.global_depth() > depth);
+
+    // a full bucket at capacity: only an insert of a new key evicts
+    hashmap<int, int, hashmap_stats> f{};
+    f.set_capacity(BUCKET_SIZE);
+    std::vector<int> keys; // keys of the depth-1 bucket of prefix 0
+    for (int k = 0; (int) keys.size() < BUCKET_SIZE + 1; ++k)
+        if (!(hashmap_hash<int>()(k) >> (SIZE_OF_HASH - 1))) keys.push_back(k);
+    for (int i = 0; i < BUCKET_SIZE; ++i)
+        f.insert(keys[i], i, 0);
+    assert(f.size() == BUCKET_SIZE && f.global_depth() == 1);
+    f.insert(keys[3], -3, 0);
+    assert(f.remove(keys[4], 0) && f.insert(keys[4], 4, 0)); // a remove leaves room, the insert takes it back
+    assert(f.merge(keys[5], 1, [](int a, int b) { return a + b; }, 0));
+    assert(f.size() == BUCKET_SIZE && f.size_approx() == BUCKET_SIZE);
+    for (int i = 0; i < BUCKET_SIZE; ++i)
+        assert(f.lookup(keys[i]).second == (i == 3 ? -3 : i == 5 ? 6 : i)); // the updates evicted nothing
+    f.insert(keys[BUCKET_SIZE], 0, 0);
+    assert(f.lookup(keys[BUCKET_SIZE]).first && f.size() == BUCKET_SIZE && f.size_approx() == BUCKET_SIZE);
+    cout << "Test #20 Finished!" << endl;
+}
+
+void test19() {
+    using std::chrono::milliseconds;
+    hashmap_ttl<int, int, hashmap_stats> m{};
+    // fill the depth-1 bucket of prefix 0 with items that expire
+    std::vector<int> keys;
+    int other = 0; // a key of the other bucket, it never expires
+    for (int k = 0; (int) keys.size() < BUCKET_SIZE + 1; ++k) {
+        if (!(hashmap_hash<int>()(k) >> (SIZE_OF_HASH - 1))) keys.push_back(k);
+        else other = k;
+    }
+    for (int i = 0; i < BUCKET_SIZE; ++i)
+        m.insert_for(keys[i], i, milliseconds(50), 0);
+    m.insert(other, -1, 0);
+    assert(m.lookup(keys[0]).first && m.global_depth() == 1);
+    usleep(100000);
+    assert(!m.lookup(keys[0]).first && !m.lookup_shared(keys[1]) && m.lookup(other).first);
+
+    m.insert(keys[BUCKET_SIZE], 0, 0); // the full bucket of expired items makes room, no split
+    assert(m.stats()[STAT_SPLIT_BUCKET] == 0 && m.global_depth() == 1);
+    assert(m.size() == 2 && m.size_approx() == 2);
+    assert(!m.exchange(keys[1], 1, 0) && m.lookup(keys[1]).second == 1); // an expired key is absent
+
+    for (int i = 0; i < 100; ++i)
+        m.insert_for(1000 + i, i, milliseconds(50), 0);
+    usleep(100000);
+    size_t purged = m.sweep(1, 1) + m.sweep(10, 1);
+    assert(purged == 100 && m.size() == 3 && m.size_approx() == 3);
+    assert(m.sweep(10, 1) == 0);
+    cout << "Test #19 Finished!" << endl;
+}
+
+void test18() {
+    hashmap<int, int> m{};
+    assert(m.empty() && m.size() == 0 && m.size_approx() == 0);
+    const int test_len = 1000;
+    for (int i = 0; i < test_len; ++i)
+        m.insert(i, i, i % 4); // spread over 4 thread ids
+    m.insert(5, 6, 0); // an update does not count
+    assert(m.size() == test_len && m.size_approx() == test_len && !m.empty());
+    for (int i = 0; i < test_len; i += 2)
+        m.remove(i, 1);
+    m.remove(0, 2); // absent
+    m.take(1, 3);
+    assert(!m.insert_if_absent(3, 0, 0).first);
+    m.fetch_add(test_len, 1, 0);
+    assert(m.size() == test_len / 2 && m.size_approx() == test_len / 2);
+    assert(m.layout_report().items == m.size());
+    cout << "Test #18 Finished!" << endl;
+}
+
+void test17() {
+    hashmap<int, int> m{};
+    assert(!m.exchange(1, 10, 0));
+    assert(m.exchange(1, 11, 0) == 10 && m.lookup(1).second == 11);
+    assert(m.take(1, 0) == 11 && !m.lookup(1).first);
+    assert(!m.take(1, 0));
+    assert(m.insert(2, 20, 0) && m.remove(2, 0) && !m.remove(2, 0)); // remove reports if the key was there
+
+    hashmap<int, session> big{};
+    big.emplace(0, 1, 1);
+    std::optional<session> old = big.exchange(1, session(2), 0);
+    assert(old && old->id == 1 && big.take(1, 0)->id == 2);
+    cout << "Test #17 Finished!" << endl;
+}
+
+struct merge_data {
+    hashmap<int, long> *m;
+    int id;
+};
+
+void *merge_thread_function(void *arg) {
+    merge_data *d = (merge_data *) arg;
+    for (int k = 0; k < 1000; ++k) {
+        d->m->fetch_add(k % 10, 1, d->id);
+        d->m->merge(-1, (long) k, [](long old, long delta) { return old > delta ? old : delta; }, d->id);
+    }
+    return nullptr;
+}
+
+void test16() {
+    hashmap<int, long> m{};
+    assert(!m.fetch_add(1, 5, 0) && m.lookup(1).second == 5);
+    assert(m.fetch_add(1, 2, 0) == 5 && m.lookup(1).second == 7);
+    assert(!m.upsert(2, 100, [](long old) { return old * 2; }, 0) && m.lookup(2).second == 100);
+    assert(m.upsert(2, 100, [](long old) { return old * 2; }, 0) == 100 && m.lookup(2).second == 200);
+
+    static const int num_threads = 8; // concurrent increments lose nothing
+    hashmap<int, long> counters{};
+    pthread_t threads[num_threads];
+    merge_data td[num_threads];
+    for (int i = 0; i < num_threads; ++i) {
+        td[i] = {&counters, i};
+        pthread_create(&threads[i], nullptr, merge_thread_function, &td[i]);
+    }
+    for (pthread_t &t : threads) pthread_join(t, nullptr);
+    for (int k = 0; k < 10; ++k)
+        assert(counters.lookup(k).second == num_threads * 100);
+    assert(counters.lookup(-1).second == 999);
+
+    hashmap<int, session> big{}; // out of line values are merged into a new cell
+    big.emplace(0, 1, 1);
+    shared_ptr<session const> before = big.lookup_shared(1);
+    big.upsert(1, session(0), [](session const &old) { return session(old.id + 1); }, 0);
+    assert(before->id == 1 && big.lookup(1).second.id == 2);
+    cout << "Test #16 Finished!" << endl;
+}
+
+void test15() {
+    hashmap<int, int> m{};
+    std::pair<bool, std::optional<int>> r = m.insert_if_absent(1, 10, 0);
+    assert(r.first && !r.second);
+    r = m.insert_if_absent(1, 11, 0);
+    assert(!r.first && r.second == 10 && m.lookup(1).second == 10);
+
+    r = m.replace_if_present(2, 20, 0);
+    assert(!r.first && !r.second && !m.lookup(2).first);
+    r = m.replace_if_present(1, 12, 0);
+    assert(r.first && r.second == 10 && m.lookup(1).second == 12);
+
+    r = m.compare_and_swap(1, 10, 13, 0);
+    assert(!r.first && r.second == 12 && m.lookup(1).second == 12);
+    r = m.compare_and_swap(1, 12, 13, 0);
+    assert(r.first && r.second == 12 && m.lookup(1).second == 13);
+    assert(!m.compare_and_swap(3, 0, 1, 0).first && !m.lookup(3).first);
+
+    r = m.remove_if_equal(1, 12, 0);
+    assert(!r.first && r.second == 13 && m.lookup(1).first);
+    r = m.remove_if_equal(1, 13, 0);
+    assert(r.first && r.second == 13 && !m.lookup(1).first);
+
+    // a counter raised by CAS retries from several threads loses no update
+    static const int num_threads = 4, increments = 500;
+    pthread_t threads[num_threads];
+    struct cas_data {
+        hashmap<int, int> *m;
+        int id;
+    } td[num_threads];
+    m.insert(100, 0, 0);
+    for (int i = 0; i < num_threads; ++i) {
+        td[i] = {&m, i};
+        pthread_create(&threads[i], nullptr, [](void *arg) -> void * {
+            cas_data *d = (cas_data *) arg;
+            for (int k = 0; k < increments; ++k) {
+                int seen = d->m->lookup(100).second;
+                std::pair<bool, std::optional<int>> res;
+                while (!(res = d->m->compare_and_swap(100, seen, seen + 1, d->id)).first)
+                    seen = *res.second;
+            }
+            return nullptr;
+        }, &td[i]);
+    }
+    for (pthread_t &t : threads) pthread_join(t, nullptr);
+    assert(m.lookup(100).second == num_threads * increments);
+    cout << "Test #15 Finished!" << endl;
+}
+
+void test14() {
+    hashmap<int, session> m{}; // above INDIRECT_VALUE_SIZE, stored out of line
+    const int test_len = 3 * BUCKET_SIZE;
+    for (int i = 0; i < test_len; ++i)
+        m.emplace(0, i, i);
+    for (int i = 0; i < test_len; ++i)
+        assert(m.lookup(i).second.id == i);
+    shared_ptr<session const> first = m.lookup_shared(7);
+    assert(first && first->id == 7 && m.lookup_shared(7) == first); // the stored cell itself
+    m.insert(7, session(70), 0);
+    m.remove(8, 0);
+    assert(first->id == 7 && m.lookup_shared(7)->id == 70 && !m.lookup_shared(8));
+
+    hashmap<int, session, hashmap_no_stats, hashmap_hash<int>, hashmap_equal<int>, hashmap_inline_value<session>> in{};
+    in.emplace(0, 1, 1);
+    assert(in.lookup(1).second.id == 1 && in.lookup_shared(1)->id == 1 && !in.lookup_shared(2));
+    cout << "Test #14 Finished!" << endl;
+}
+
+void test13() {
+    hashmap<byte_key, std::string> m{};
+    std::string value(1000, 'v');
+    assert(m.insert(byte_key("moved"), std::move(value), 0));
+    assert(m.lookup("moved").second.size() == 1000);
+    assert(m.emplace(1, "built", 5, 'x')); // std::string(5, 'x') built in the op record
+    assert(m.lookup("built").second == "xxxxx");
+    assert(m.emplace(1, "built", "again") && m.lookup("built").second == "again"); // emplace updates
+
+    assert(!m.try_emplace(0, "built", "ignored") && m.lookup("built").second == "again");
+    for (int i = 0; i < 3 * BUCKET_SIZE; ++i) // absent keys, across bucket splits
+        assert(m.try_emplace(0, std::to_string(i), i, 'y'));
+    for (int i = 0; i < 3 * BUCKET_SIZE; ++i) {
+        assert(m.lookup(std::to_string(i)).second == std::string(i, 'y'));
+        assert(!m.try_emplace(1, std::to_string(i), "ignored"));
+    }
+    cout << "Test #13 Finished!" << endl;
+}
+
+void test12() {
+    hashmap<byte_key, int> m{};
+    const int test_len = 500;
+    for (int i = 0; i < test_len; ++i)
+        m.insert("request/header/" + std::to_string(i), i, 0);
+    char buf[64];
+    for (int i = 0; i < test_len; ++i) {
+        snprintf(buf, sizeof(buf), "request/header/%d", i);
+        std::string_view probe(buf); // no byte_key is built for the lookup
+        std::pair<bool, int> t = m.find(probe);
+        assert(t.first && t.second == i);
+        assert(m.find(buf).second == i);
+    }
+    assert(!m.find("request/header/").first && !m.find(std::string("request/header/x")).first);
+
+    hashmap<std::string, int> s{};
+    s.insert("abc", 1, 0);
+    assert(s.find(std::string_view("abc")).second == 1 && !s.find("ab").first);
+    cout << "Test #12 Finished!" << endl;
+}
+
+void test11() {
+    hashmap<byte_key, int> m{};
+    const int test_len = 2000;
+    auto make_key = [](int i) { // short keys stay inline, the others go to a shared blob
+        std::string k = "session/" + std::to_string(i);
+        if (i % 2) k += "/user-agent/with/a/longer/tail";
+        return k;
+    };
+    for (int i = 0; i < test_len; ++i) {
+        bool st = m.insert(make_key(i), i, 0);
+        assert(st);
+    }
+    for (int i = 0; i < test_len; ++i) {
+        std::pair<bool, int> t = m.lookup(make_key(i));
+        assert(t.first && t.second == i);
+    }
+    for (int i = 0; i < test_len; i += 3)
+        m.remove(make_key(i), 0);
+    for (int i = 0; i < test_len; ++i)
+        assert(m.lookup(make_key(i)).first == (i % 3 != 0));
+    assert(!m.lookup(byte_key("session/")).first);
+
+    byte_key small("abc"), large(make_key(1)), copy(large);
+    assert(small.size() == 3 && small.view() == "abc");
+    assert(copy == large && copy.data() == large.data()); // copies share the blob
+    assert(large != byte_key(make_key(3)) && byte_key() == byte_key(""));
+
+    hashmap<std::string, int> s{}; // std::string hashes its contents too
+    for (int i = 0; i < 200; ++i) s.insert(make_key(i), i, 0);
+    for (int i = 0; i < 200; ++i) assert(s.lookup(make_key(i)).second == i);
+    cout << "Test #11 Finished!" << endl;
+}
+
+void test10() {
+    const char *path = "test10.trace";
+    hashmap<int, int> m{};
+    {
+        trace_recorder recorder(path);
+        assert(recorder.IsOpen());
+        recording_hashmap<int, int> rm(m, recorder);
+        for (int i = 0; i < 100; ++i) rm.insert(i, i, 0);
+        for (int i = 0; i < 100; ++i) assert(rm.lookup(i, 1).first);
+        rm.remove(7, 0);
+    } // the recorder flushes on destruction
+    assert(!m.lookup(7).first && m.lookup(8).first);
+
+    std::vector<trace_record> records;
+    assert(ReadTrace(path, records) && records.size() == 201);
+    int per_op[3] = {0, 0, 0};
+    for (trace_record const &r : records) {
+        per_op[r.op]++;
+        assert(r.value_size == sizeof(int) && r.key < 100);
+        assert(r.thread == (r.op == TRACE_LOOKUP ? 1 : 0));
+    }
+    assert(per_op[TRACE_INSERT] == 100 && per_op[TRACE_REMOVE] == 1 && per_op[TRACE_LOOKUP] == 100);
+    remove(path);
+    cout << "Test #10 Finished!" << endl;
+}
+
+void test09() {
+    hashmap<int, int> m{};
+    const int test_len = 2000;
+    for (int i = 0; i < test_len; ++i)
+        m.insert(i, i, 0);
+    hashmap_layout_report r = m.layout_report();
+    assert(r.items == test_len);
+    uint64_t buckets = 0, entries = 0, items = 0;
+    for (size_t d = 0; d <= r.global_depth; ++d) {
+        buckets += r.local_depth_hist[d];
+        entries += r.local_depth_hist[d] << (r.global_depth - d); // each bucket covers 2^(D-d) entries
+    }
+    for (size_t d = r.global_depth + 1; d <= SIZE_OF_HASH; ++d)
+        assert(r.local_depth_hist[d] == 0); // no bucket is deeper than the directory
+    for (int n = 0; n <= BUCKET_SIZE; ++n)
+        items += n * r.occupancy_hist[n];
+    assert(buckets == r.unique_buckets && entries == POW(r.global_depth) && items == r.items);
+    assert(r.unique_buckets * BUCKET_SIZE >= test_len && r.longest_run >= 1);
+    assert(r.directory_bytes > 0 && r.bstate_bytes > 0);
+    cout << "Test #09 Finished!" << endl;
+}
+
+void test08() {
+    hashmap<int, int, hashmap_stats> m{};
+    const int test_len = 3 * BUCKET_SIZE;
+    for (int i = 0; i < test_len; ++i) {
+        bool st = m.insert(i, i, 0);
+        assert(st);
+    }
+    for (int i = 0; i < test_len; ++i) {
+        std::pair<bool, int> t = m.lookup(i);
+        assert(t.first && t.second == i);
+    }
+    m.remove(0, 1);
+    hashmap_stats_snapshot s = m.stats();
+    assert(s[STAT_INSERT] == test_len && s[STAT_REMOVE] == 1 && s[STAT_LOOKUP] == test_len);
+    assert(s[STAT_MAKEOP_LOOPS] + s[STAT_FAST_PATH] >= test_len + 1);
+    assert(s[STAT_CAS_SUCCESS] > 0 && s[STAT_SPLIT_BUCKET] > 0 && s[STAT_RESIZE_SWAP] > 0);
+    assert(s[STAT_BSTATE_BYTES] > 0);
+
+    hashmap<int, int> m_off{}; // default policy counts nothing
+    m_off.insert(1, 1, 0);
+    assert(m_off.stats()[STAT_INSERT] == 0);
+    cout << "Test #08 Finished!" << endl;
+}
+
 void test07() {
     start_the_threads_global_flag = false;
     static const int num_threads = 8;
@@ -225,6 +756,24 @@ int main() {
     test05(); // test insert with threads running in parallel
     test06(); // test remove with threads running separately
     test07(); // test remove with threads running in parallel
+    test08(); // test the statistics counters
+    test09(); // test the layout report
+    test10(); // test recording a trace
+    test11(); // test variable length keys
+    test12(); // test lookup by a key of another type
+    test13(); // test move insert, emplace and try_emplace
+    test14(); // test out of line values
+    test15(); // test the conditional operations
+    test16(); // test merge, upsert and fetch_add
+    test17(); // test exchange, take and the status of remove
+    test18(); // test size and size_approx
+    test19(); // test expiring items
+    test20(); // test the capacity mode
+    test21(); // test submitted ops and progress
+    test22(); // test lookup_batch
+    test23(); // test batch hashing
+    test24(); // test repeated writes to the same bucket states under both engines
+    test25(); // test the fast path
 
     return 0;
 }
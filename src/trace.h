@@ -0,0 +1,170 @@
+#ifndef EWRHT_TRACE_H
+#define EWRHT_TRACE_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "hashmap.h"
+
+/*** Operation traces ***/
+/**A trace file is a trace_header followed by trace_records. Records are
+ * written in per-thread chunks, so the file is ordered per thread but not
+ * globally; readers sort by (thread, timestamp) when they need to.
+ * @key - the key itself for trivially copyable keys of up to 8 bytes, else
+ * the 64 bit xxhash of its bytes, or of its contents for byte_key and
+ * std::string (replays then keep the key distribution).
+ * @timestamp_ns - nanoseconds since the recorder was created.
+ * **/
+
+#define TRACE_MAGIC "WFHTTRC1"
+#define TRACE_CHUNK_RECORDS (4096)
+
+enum Trace_op : uint8_t {
+    TRACE_INSERT, TRACE_REMOVE, TRACE_LOOKUP
+};
+
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+struct trace_record {
+    uint64_t timestamp_ns;
+    uint64_t key;
+    uint32_t value_size;
+    uint16_t thread;
+    uint8_t op;
+    uint8_t reserved;
+};
+
+static_assert(sizeof(trace_record) == 24, "trace_record is part of the file format");
+
+template<typename Key>
+uint64_t TraceKey(Key const &key) {
+    if constexpr (std::is_trivially_copyable<Key>::value && sizeof(Key) <= sizeof(uint64_t)) {
+        uint64_t res = 0;
+        memcpy(&res, &key, sizeof(Key));
+        return res;
+    } else {
+        const void *kptr = &key;
+        return xxh::xxhash<64>(kptr, sizeof(Key));
+    }
+}
+
+// Variable length keys are recorded by the hash of their contents
+inline uint64_t TraceKey(byte_key const &key) {
+    return xxh::xxhash<64>(key.data(), key.size());
+}
+
+inline uint64_t TraceKey(std::string const &key) {
+    return xxh::xxhash<64>(key.data(), key.size());
+}
+
+/* Collects records in a buffer per thread id, a full buffer is appended to the
+ * file under a mutex, which is the only shared step. */
+class trace_recorder {
+    struct alignas(64) Buffer {
+        std::vector<trace_record> records;
+    };
+
+    FILE *file;
+    std::mutex file_lock;
+    Buffer buffers[NUMBER_OF_THREADS];
+    std::chrono::steady_clock::time_point start;
+
+    void Write(std::vector<trace_record> &records) {
+        std::lock_guard<std::mutex> guard(file_lock);
+        if (file && !records.empty())
+            fwrite(records.data(), sizeof(trace_record), records.size(), file);
+        records.clear();
+    }
+
+public:
+    explicit trace_recorder(std::string const &path) : start(std::chrono::steady_clock::now()) {
+        file = fopen(path.c_str(), "wb");
+        if (!file) return;
+        trace_header h{};
+        memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+        h.version = 1;
+        h.record_size = sizeof(trace_record);
+        fwrite(&h, sizeof(h), 1, file);
+        for (Buffer &b : buffers) b.records.reserve(TRACE_CHUNK_RECORDS);
+    }
+
+    trace_recorder(trace_recorder const &) = delete;
+
+    trace_recorder operator=(trace_recorder) = delete;
+
+    ~trace_recorder() {
+        Flush();
+        if (file) fclose(file);
+    }
+
+    bool IsOpen() const {
+        return file != nullptr;
+    }
+
+    void Record(Trace_op op, uint64_t key, uint32_t value_size, unsigned int const id) {
+        assert(id < NUMBER_OF_THREADS);
+        uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        std::vector<trace_record> &records = buffers[id].records;
+        records.push_back({now, key, value_size, (uint16_t) id, op, 0});
+        if (records.size() == TRACE_CHUNK_RECORDS) Write(records);
+    }
+
+    /* Not thread safe against Record, call once the recorded threads are done */
+    void Flush() {
+        for (Buffer &b : buffers) Write(b.records);
+        std::lock_guard<std::mutex> guard(file_lock);
+        if (file) fflush(file);
+    }
+};
+
+/* Reads a whole trace, returns false for a missing or malformed file */
+inline bool ReadTrace(std::string const &path, std::vector<trace_record> &out) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    trace_header h{};
+    bool ok = fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) == 0
+              && h.record_size == sizeof(trace_record);
+    trace_record r{};
+    while (ok && fread(&r, sizeof(r), 1, f) == 1)
+        out.push_back(r);
+    fclose(f);
+    return ok;
+}
+
+/* The hashmap with every insert/remove/lookup recorded; lookups take the
+ * thread id too, so that every record belongs to one thread's order. */
+template<typename Key, typename Value, typename Map = hashmap<Key, Value>>
+class recording_hashmap {
+    Map &m;
+    trace_recorder &recorder;
+
+public:
+    recording_hashmap(Map &m, trace_recorder &recorder) : m(m), recorder(recorder) {}
+
+    std::pair<bool, Value> lookup(Key const &key, unsigned int const id) const {
+        recorder.Record(TRACE_LOOKUP, TraceKey(key), sizeof(Value), id);
+        return m.lookup(key);
+    }
+
+    bool insert(Key const &key, Value const &value, unsigned int const id) {
+        recorder.Record(TRACE_INSERT, TraceKey(key), sizeof(Value), id);
+        return m.insert(key, value, id);
+    }
+
+    bool remove(Key const &key, unsigned int const id) {
+        recorder.Record(TRACE_REMOVE, TraceKey(key), sizeof(Value), id);
+        return m.remove(key, id);
+    }
+};
+
+#endif //EWRHT_TRACE_H